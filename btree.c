@@ -8,8 +8,11 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "btree.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
 
 /*
  * create a new node with the provided data and return it
@@ -21,28 +24,245 @@ BTreeNewNode(int key, node_td *parent, int index, void *data)
     node_td	*p;
 
     p = (node_td *) malloc(sizeof(node_td));
+    BTREE_STATS_ADD(allocated, 1);
 
     p->key = key;
     p->index = index;
+    p->refcnt = 1;
+    p->size = 1;
+    p->valsize = 0;
     p->data = data;
 
     p->left = (node_td *) NULL;
     p->right = (node_td *) NULL;
     p->parent = parent;
+    p->block = (nodeblock_td *) NULL;
 
     return p;
 }
 
+/*
+ * allocate <count> nodes with a single malloc and return them as an array
+ *
+ * Used when we know up front how many nodes we need (building a tree from
+ * sorted keys, set operations, etc.) so we don't pay a malloc per node and
+ * the nodes end up next to each other in memory.
+ *
+ * Each node is still freed on its own with BTreeFreeNode(); the block memory
+ * is returned when the last node in it is freed.
+ */
+node_td *
+BTreeNewNodeBlock(int count)
+{
+    nodeblock_td	*blk;
+    node_td		*nodes;
+    int			i;
+
+    if (count <= 0)
+	return (node_td *) NULL;
+
+    blk = (nodeblock_td *) malloc(sizeof(nodeblock_td) + count * sizeof(node_td));
+    blk->live = count;
+    blk->count = count;
+    BTREE_STATS_ADD(allocated, count);
+
+    nodes = (node_td *) (blk + 1);
+    for (i=0; i<count; i++) {
+	nodes[i].left = (node_td *) NULL;
+	nodes[i].right = (node_td *) NULL;
+	nodes[i].parent = (node_td *) NULL;
+	nodes[i].data = NULL;
+	nodes[i].refcnt = 1;
+	nodes[i].size = 1;
+	nodes[i].valsize = 0;
+	nodes[i].block = blk;
+    }
+
+    return nodes;
+}
+
+/*
+ * where a value node keeps its value (see btree.h)
+ */
+#define VALUE_PTR(p)	((void *) ((p) + 1))
+
+/* store a copy of <value> (zeros if NULL) in value node <p> */
+static void
+initValue(node_td *p, const void *value, int valsize)
+{
+    p->valsize = valsize;
+    p->data = VALUE_PTR(p);
+    if (value != NULL)
+	memcpy(p->data, value, valsize);
+    else
+	memset(p->data, 0, valsize);
+}
+
+/*
+ * create a new node that holds a copy of the <valsize> bytes at <value>
+ * inline (NULL value: all zeros)
+ *
+ * The value lives in the same allocation as the node, so reaching it from
+ * a found node costs no extra allocation and (for small values) no extra
+ * cache miss. p->data points at the value; use BTreeNodeGetValue() and
+ * BTreeNodeSetValue() to copy it out and in. A tree is expected to use one
+ * value size for all its nodes.
+ */
+node_td *
+BTreeNewValueNode(int key, node_td *parent, int index, const void *value, int valsize)
+{
+    node_td	*p;
+
+    if (valsize <= 0)
+	return BTreeNewNode(key, parent, index, (void *) value);
+
+    p = (node_td *) malloc(BTREE_NODE_BYTES(valsize));
+    BTREE_STATS_ADD(allocated, 1);
+
+    p->key = key;
+    p->index = index;
+    p->refcnt = 1;
+    p->size = 1;
+
+    p->left = (node_td *) NULL;
+    p->right = (node_td *) NULL;
+    p->parent = parent;
+    p->block = (nodeblock_td *) NULL;
+
+    initValue(p, value, valsize);
+
+    return p;
+}
+
+/*
+ * BTreeNewNodeBlock() for value nodes: <count> nodes with room for a
+ * <valsize> byte value each (values zeroed).
+ *
+ * The nodes are BTREE_NODE_BYTES(valsize) apart, get node i with
+ * BTREE_BLOCK_NODE(nodes, i, valsize).
+ */
+node_td *
+BTreeNewValueBlock(int count, int valsize)
+{
+    nodeblock_td	*blk;
+    node_td		*nodes, *p;
+    int			i;
+
+    if (valsize <= 0)
+	return BTreeNewNodeBlock(count);
+
+    if (count <= 0)
+	return (node_td *) NULL;
+
+    blk = (nodeblock_td *) malloc(sizeof(nodeblock_td) + (long) count * BTREE_NODE_BYTES(valsize));
+    blk->live = count;
+    blk->count = count;
+    BTREE_STATS_ADD(allocated, count);
+
+    nodes = (node_td *) (blk + 1);
+    for (i=0; i<count; i++) {
+	p = BTREE_BLOCK_NODE(nodes, i, valsize);
+	p->left = (node_td *) NULL;
+	p->right = (node_td *) NULL;
+	p->parent = (node_td *) NULL;
+	p->refcnt = 1;
+	p->size = 1;
+	p->block = blk;
+	initValue(p, NULL, valsize);
+    }
+
+    return nodes;
+}
+
+/*
+ * size of the value stored inline in <p>, 0 if <p> is a plain node
+ * (its data is just a pointer)
+ */
+int
+BTreeNodeValueSize(node_td *p)
+{
+    if (p == (node_td *) NULL)
+	return 0;
+
+    return p->valsize;
+}
+
+/*
+ * copy the inline value of <p> to <value>
+ *
+ * Returns the number of bytes copied (0 for a plain node).
+ */
+int
+BTreeNodeGetValue(node_td *p, void *value)
+{
+    int		valsize;
+
+    valsize = BTreeNodeValueSize(p);
+    if (valsize > 0)
+	memcpy(value, p->data, valsize);
+
+    return valsize;
+}
+
+/*
+ * overwrite the inline value of <p> with the bytes at <value>
+ * (for a plain node this just sets the data pointer)
+ */
+void
+BTreeNodeSetValue(node_td *p, const void *value)
+{
+    int		valsize;
+
+    valsize = BTreeNodeValueSize(p);
+    if (valsize > 0)
+	memcpy(p->data, value, valsize);
+    else
+	p->data = (void *) value;
+}
+
+/*
+ * make an unlinked copy of node <p>: key, index and size, and its inline
+ * value (a plain node's copy shares the data pointer)
+ */
+node_td *
+BTreeCopyNode(node_td *p)
+{
+    node_td	*q;
+    int		valsize;
+
+    valsize = BTreeNodeValueSize(p);
+    if (valsize > 0)
+	q = BTreeNewValueNode(p->key, (node_td *) NULL, p->index, p->data, valsize);
+    else
+	q = BTreeNewNode(p->key, (node_td *) NULL, p->index, p->data);
+    q->size = p->size;
+
+    return q;
+}
+
 /*
  * empty out and free a node's memory
  *
+ * Nodes that came from BTreeNewNodeBlock() just drop their reference on the
+ * block (atomically, trees in different threads may share a block).
  */
 void
 BTreeFreeNode(node_td *node)
 {
+    nodeblock_td	*blk;
+
     if (node == (node_td *)NULL)
 	return;
 
+    BTREE_STATS_ADD(freed, 1);
+
+    blk = node->block;
+    if (blk != (nodeblock_td *) NULL) {
+	if (__sync_sub_and_fetch(&blk->live, 1) == 0)
+	    free(blk);
+	return;
+    }
+
     free(node);
 }
 
@@ -55,13 +275,19 @@ BTreeFreeNode(node_td *node)
 node_td *
 BTreeFreeTree(node_td *root)
 {
-    if (root == (node_td *)NULL)
+    BTREE_TRACE_ENTER(tree, root);
+
+    if (root == (node_td *)NULL) {
+	BTREE_TRACE_QUIET(tree);
 	return (node_td *)NULL;
+    }
 
     root->left = BTreeFreeTree(root->left);
     root->right = BTreeFreeTree(root->right);
     BTreeFreeNode(root);
     root = (node_td *)NULL;
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_FREE, tree, root, 0, 0);
     return (root);
 }
 
@@ -99,19 +325,51 @@ BTreeNodeIsLeaf(node_td *p)
  * in an array. We will use this info as a position to print out the array
  * in a pretty tree format.
  */
-node_td *
-BTreeInsertNode(node_td *root, int key, node_td *parent, int index, void *data)
+static node_td *
+insertNode(node_td *root, int key, node_td *parent, int index, void *data, int valsize)
 {
     if (root == (node_td *) NULL) {
-	return BTreeNewNode(key, parent, index, data);
+	return BTreeNewValueNode(key, parent, index, data, valsize);
     } else if (key < root->key) { /* add down left child sub-tree */ 
-	root->left = BTreeInsertNode(root->left, key, root, (2*root->index)+1, data);
+	root->left = insertNode(root->left, key, root, (2*root->index)+1, data, valsize);
     } else if (key > root->key) { /* add down right child sub-tree */
-	root->right = BTreeInsertNode(root->right, key, root, (2*root->index)+2, data);
+	root->right = insertNode(root->right, key, root, (2*root->index)+2, data, valsize);
     } else if (key == root->key) { /* duplicate key, ignore */
 	/* ignore */
     }
 
+    root->size = 1 + BTREE_SIZE(root->left) + BTREE_SIZE(root->right);
+    return root;
+}
+
+node_td *
+BTreeInsertNode(node_td *root, int key, node_td *parent, int index, void *data)
+{
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, root);
+
+    root = insertNode(root, key, parent, index, data, 0);
+
+    BTREE_STATS_LATENCY(BTREE_OP_INSERT, start);
+    BTREE_TRACE_LEAVE(BTREE_TRACE_INSERT, tree, root, key, 0);
+    return root;
+}
+
+/*
+ * insert <key> with a copy of the <valsize> bytes at <value> stored inline
+ * in the new node (see BTreeNewValueNode()). An existing <key> is left alone,
+ * like BTreeInsertNode().
+ */
+node_td *
+BTreeInsertValue(node_td *root, int key, const void *value, int valsize)
+{
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, root);
+
+    root = insertNode(root, key, (node_td *) NULL, 0, (void *) value, valsize);
+
+    BTREE_STATS_LATENCY(BTREE_OP_INSERT, start);
+    BTREE_TRACE_LEAVE(BTREE_TRACE_INSERT, tree, root, key, 0);
     return root;
 }
 
@@ -145,23 +403,45 @@ BTreeGetHeight(node_td *node)
  * Efficiently traverse the tree looking for node with <key>
  *
  * If found, return it. If not found, return NULL
+ *
+ * (a loop rather than recursion, so we can count levels and compares
+ * for btree_stats.c)
  */
+static node_td *
+findNode(node_td *root, int key)
+{
+    int		levels = 0;
+
+    while (root != (node_td *) NULL) {
+	levels++;
+	if (key == root->key) {
+	    BTREE_STATS_LOOKUP(levels, 2*levels-1);
+	    return root;
+	}
+
+	if (key < root->key) {
+	    root = root->left;		/* follow left subtree */
+	} else {
+	    root = root->right;		/* follow right subtree */
+	}
+    }
+
+    BTREE_STATS_LOOKUP(levels, 2*levels);
+    return (node_td *) NULL;		/* not found */
+}
+
 node_td *
 BTreeFindNode(node_td *root, int key)
 {
-    if (root == (node_td *) NULL) {	/* not found */
-	return (node_td *) NULL;
-    }
+    node_td	*p;
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, root);
 
-    if (key == root->key) {
-        return root;
-    }
+    p = findNode(root, key);
 
-    if (key < root->key) {
-        return BTreeFindNode(root->left, key);	/* follow left subtree */
-    } else {
-        return BTreeFindNode(root->right, key);	/* follow right subtree */
-    }
+    BTREE_STATS_LATENCY(BTREE_OP_FIND, start);
+    BTREE_TRACE_LEAVE(BTREE_TRACE_FIND, tree, root, key, p != (node_td *) NULL);
+    return p;
 }
 
 /* Temporary data structures and functions for some of the more complicated operations
@@ -178,8 +458,14 @@ typedef struct nodelist_st
     struct nodelist_st	*next;
 } nodelist_td;
 
-static nodelist_td	*tempNodeList = (nodelist_td *)NULL;
-static int		tempListLength = 0;
+/* the list itself. It lives on the caller's stack, so trees in different
+ * threads can delete/rebalance at the same time
+ */
+typedef struct templist_st
+{
+    nodelist_td		*head, *tail;
+    int			length;
+} templist_td;
 
 /*
  * utility function.
@@ -190,29 +476,27 @@ static int		tempListLength = 0;
  * The traversal is "preorder" traversal
  */
 static void
-buildTempList(node_td *subtree)
+buildTempList(templist_td *list, node_td *subtree)
 {
     nodelist_td		*p;
 
     if (subtree != (node_td *)NULL) {
 
-	if (tempNodeList == (nodelist_td *) NULL) {	/* first item in tempNodeList */
-	    tempNodeList = (nodelist_td *) malloc(sizeof(nodelist_td));
-	    tempNodeList->node = subtree;
-	    tempNodeList->next = (nodelist_td *) NULL;
-	    tempListLength = 1;
+	p = (nodelist_td *) malloc(sizeof(nodelist_td));
+	p->node = subtree;
+	p->next = (nodelist_td *) NULL;
+
+	if (list->head == (nodelist_td *) NULL) {	/* first item in the list */
+	    list->head = p;
+	    list->length = 1;
 	} else {
-	    p = tempNodeList;	/* append at the end of the list */
-	    while (p->next != (nodelist_td *) NULL) { 
-	        p = p->next;
-            }
-	    p->next = (nodelist_td *) malloc(sizeof(nodelist_td));
-	    p->next->node = subtree;
-	    p->next->next = (nodelist_td *) NULL;
-	    tempListLength++;
+	    list->tail->next = p;	/* append at the end of the list */
+	    list->length++;
 	}
-	buildTempList(subtree->left);
-	buildTempList(subtree->right);
+	list->tail = p;
+
+	buildTempList(list, subtree->left);
+	buildTempList(list, subtree->right);
     }
 }
 
@@ -221,13 +505,13 @@ buildTempList(node_td *subtree)
  * a utility to follow and print out the temporary list, for debugging
  */
 static void
-printTempList(void)
+printTempList(templist_td *list)
 {
     nodelist_td		*p;
 
     fprintf(stdout,"tempNodeList ");
 
-    p = tempNodeList;
+    p = list->head;
     while (p != (nodelist_td *) NULL) { 
 	fprintf(stdout,"--> (%d) ",p->node->key);
         p = p->next;
@@ -240,40 +524,153 @@ printTempList(void)
  * after we are done, we want to clean up the temporary list and it's memory
  */
 static void
-freeTempList(void)
+freeTempList(templist_td *list)
 {
     nodelist_td	*node, *tp;
     
-    if (tempNodeList != (nodelist_td *) NULL) {
-        node = tempNodeList->next;
-        free(tempNodeList);
-	tempNodeList = (nodelist_td *) NULL;
-
-        while (node != (nodelist_td *) NULL) {
-            tp = node->next;
-	    free(node);
-	    node = tp;
-        }
+    node = list->head;
+    while (node != (nodelist_td *) NULL) {
+        tp = node->next;
+	free(node);
+	node = tp;
+    }
+
+    list->head = (nodelist_td *) NULL;
+    list->tail = (nodelist_td *) NULL;
+    list->length = 0;
+}
+
+/*
+ * hang node <n> (links already cleared) into the tree at the spot for its
+ * key, like insertNode() does with a new node
+ */
+static node_td *
+linkNode(node_td *root, node_td *n, node_td *parent, int index)
+{
+    if (root == (node_td *) NULL) {
+	n->parent = parent;
+	n->index = index;
+	return n;
+    } else if (n->key < root->key) {
+	root->left = linkNode(root->left, n, root, (2*root->index)+1);
+    } else {
+	root->right = linkNode(root->right, n, root, (2*root->index)+2);
     }
+
+    root->size = 1 + BTREE_SIZE(root->left) + BTREE_SIZE(root->right);
+    return root;
 }
 
 /*
  * process the temporary list and insert the nodes back into the tree.
  * Notice that the root is a **pointer, we have to handle the case that the
  * root node changes, so we need a pointer to it, not just it's value
+ *
+ * The nodes themselves are re-linked (the list was built before we touch
+ * any of their links), so their data, inline values and node pointers
+ * held elsewhere stay good.
  */
 static void
-addTempListToTree(node_td **root)
+addTempListToTree(templist_td *list, node_td **root)
 {
     nodelist_td	*node;
+    node_td	*n;
 
-    node = tempNodeList;
+    node = list->head;
     while (node != (nodelist_td *) NULL) {
-        *root = BTreeInsertNode(*root, node->node->key, *root, 0, node->node->data);
+	n = node->node;
+        *root = BTreeLinkNode(*root, n);
         node = node->next;
     }
 }
 
+/*
+ * a subtree of <count> nodes was cut off below <p>, fix the sizes up to the root
+ */
+static void
+shrinkAncestors(node_td *p, int count)
+{
+    for (; p != (node_td *) NULL; p = p->parent) {
+	p->size -= count;
+    }
+}
+
+/* put <n> where <old> hangs below <parent> (or at the root) */
+static void
+replaceChild(node_td **root, node_td *parent, node_td *old, node_td *n)
+{
+    if (n != (node_td *) NULL)
+	n->parent = parent;
+
+    if (parent == (node_td *) NULL) {
+	*root = n;
+    } else if (parent->left == old) {
+	parent->left = n;
+    } else {
+	parent->right = n;
+    }
+}
+
+/*
+ * hang node <n> (not in any tree, its key not in this one) into the tree
+ * at <root> as a leaf, at the spot for its key
+ *
+ * Returns the new root.
+ */
+node_td *
+BTreeLinkNode(node_td *root, node_td *n)
+{
+    n->left = (node_td *) NULL;
+    n->right = (node_td *) NULL;
+    n->size = 1;
+
+    return linkNode(root, n, (node_td *) NULL, 0);
+}
+
+/*
+ * take node <p> out of the tree at <*root> without freeing it
+ *
+ * Unlike BTreeDeleteNode(), which re-inserts everything below the node,
+ * this is one walk down: a node with two children is replaced by its
+ * successor (the leftmost node on its right), otherwise by its only
+ * child. The child that moves up a level keeps the index of its old
+ * spot, like the nodes below it (indexes are only used for printing,
+ * BTreeRebalance() sets them again).
+ */
+void
+BTreeUnlinkNode(node_td **root, node_td *p)
+{
+    node_td	*s, *q;
+
+    shrinkAncestors(p->parent, 1);
+
+    if (p->left == (node_td *) NULL || p->right == (node_td *) NULL) {
+	replaceChild(root, p->parent, p,
+		     (p->left != (node_td *) NULL) ? p->left : p->right);
+	return;
+    }
+
+    for (s = p->right; s->left != (node_td *) NULL; s = s->left)
+	;
+
+	/* take the successor out of its spot (it has no left child) */
+    if (s != p->right) {
+	for (q = s->parent; q != p; q = q->parent) {
+	    q->size--;
+	}
+	replaceChild(root, s->parent, s, s->right);
+	s->right = p->right;
+	s->right->parent = s;
+    }
+
+	/* and put it where p was */
+    s->left = p->left;
+    s->left->parent = s;
+    s->size = p->size - 1;
+    s->index = p->index;
+    replaceChild(root, p->parent, p, s);
+}
+
 /*
  * remove a node from the tree
  *
@@ -282,16 +679,17 @@ addTempListToTree(node_td **root)
  * Notice that the root is a **pointer, we have to handle the case that the
  * root node changes, so we need a pointer to it, not just it's value
  */
-int
-BTreeDeleteNode(node_td **root, int key)
+static int
+deleteNode(node_td **root, int key)
 {
     node_td	*deleteme, *parent;
     node_td	*subtreeL, *subtreeR;
+    templist_td	list = { (nodelist_td *) NULL, (nodelist_td *) NULL, 0 };
 
     if (*root == (node_td *) NULL)
 	return 0;	/* empty tree, return false */
 
-    deleteme = BTreeFindNode(*root, key);
+    deleteme = findNode(*root, key);
 
     if (deleteme == (node_td *)NULL) {
 	return 0;	/* node to delete not found, return false */
@@ -317,6 +715,7 @@ BTreeDeleteNode(node_td **root, int key)
         if (key < parent->key)
 	    parent->left = (node_td *) NULL;
 
+        shrinkAncestors(parent, 1);
         BTreeFreeNode(deleteme);
 
 	    /* nothing else to do */
@@ -328,6 +727,7 @@ BTreeDeleteNode(node_td **root, int key)
 	 * we remove the node but must re-insert nodes of the 2 subtrees
    	 * we do this by traversing the subtrees, making a temporary linked list
          * of all nodes, then process that list to re-insert the nodes into the tree
+	 * (only deleteme is freed, the other nodes are moved, not copied)
 	 */
 
 	/* if the node to remove was the root, special case:
@@ -337,35 +737,38 @@ BTreeDeleteNode(node_td **root, int key)
 	
         BTreeFreeNode(deleteme);
 	*root = (node_td *) NULL;
-        tempNodeList = (nodelist_td *) NULL;
 
 	    /* choose one child to be the new root: */
 
 	if (subtreeL != (node_td *)NULL) { 
 
-            *root = BTreeNewNode(subtreeL->key, NULL, 0, subtreeL->data);
-            buildTempList(subtreeL->left);
-            buildTempList(subtreeL->right);
-            buildTempList(subtreeR);
+            *root = subtreeL;
+            buildTempList(&list, subtreeL->left);
+            buildTempList(&list, subtreeL->right);
+            buildTempList(&list, subtreeR);
 
         } else if (subtreeR != (node_td *)NULL) {
 
-            *root = BTreeNewNode(subtreeR->key, NULL, 0, subtreeR->data);
-            buildTempList(subtreeL);
-            buildTempList(subtreeR->left);
-            buildTempList(subtreeR->right);
+            *root = subtreeR;
+            buildTempList(&list, subtreeL);
+            buildTempList(&list, subtreeR->left);
+            buildTempList(&list, subtreeR->right);
 
         } else {
 	    /* can't happen (was a leaf node, already handled that case) */
         }
 
-        addTempListToTree(root);
- 
-        subtreeL = BTreeFreeTree(subtreeL);	/* must free old tree(s) after we add the nodes */
-        subtreeR = BTreeFreeTree(subtreeR);
+	    /* the chosen child starts the tree over on its own */
+        (*root)->left = (node_td *) NULL;
+        (*root)->right = (node_td *) NULL;
+        (*root)->parent = (node_td *) NULL;
+        (*root)->index = 0;
+        (*root)->size = 1;
+
+        addTempListToTree(&list, root);
+        BTREE_STATS_ADD(reinserted, list.length + 1);
 
-        freeTempList();
-        tempNodeList = (nodelist_td *) NULL;
+        freeTempList(&list);
 
 	return 1;
     }
@@ -379,69 +782,484 @@ BTreeDeleteNode(node_td **root, int key)
     if (key < parent->key)
 	parent->left = (node_td *) NULL;
 
+    shrinkAncestors(parent, deleteme->size);
+
 	/* build a temp list of subtree nodes, then re-add them to the tree */
 
-    tempNodeList = (nodelist_td *) NULL;
-    buildTempList(subtreeL);
-    buildTempList(subtreeR);
-    addTempListToTree(root);
+    buildTempList(&list, subtreeL);
+    buildTempList(&list, subtreeR);
+    addTempListToTree(&list, root);
+    BTREE_STATS_ADD(reinserted, list.length);
 
-    subtreeL = BTreeFreeTree(subtreeL);	/* must free old tree(s) after we add the nodes */
-    subtreeL = BTreeFreeTree(subtreeR);
     BTreeFreeNode(deleteme);
-    freeTempList();
-    tempNodeList = (nodelist_td *) NULL;
+    freeTempList(&list);
 
     return 1;
 }
 
+int
+BTreeDeleteNode(node_td **root, int key)
+{
+    int		deleted;
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, *root);
+
+    deleted = deleteNode(root, key);
+
+    BTREE_STATS_LATENCY(BTREE_OP_DELETE, start);
+    BTREE_TRACE_LEAVE(BTREE_TRACE_DELETE, tree, *root, key, deleted);
+    return deleted;
+}
+
+/*
+ * append the nodes of the subtree at <p> to <nodes> in key order
+ * (<*count> is the number of nodes already there)
+ */
+void
+BTreeListNodes(node_td *p, node_td **nodes, int *count)
+{
+    if (p == (node_td *) NULL)
+	return;
+
+    BTreeListNodes(p->left, nodes, count);
+    nodes[(*count)++] = p;
+    BTreeListNodes(p->right, nodes, count);
+}
+
+/*
+ * re-link sorted nodes[lo..hi] as a perfectly balanced subtree below
+ * <parent>, its top at heap index <index>
+ *
+ * Returns the top of the subtree (the caller hangs it in).
+ */
+node_td *
+BTreeRelinkNodes(node_td **nodes, int lo, int hi, node_td *parent, int index)
+{
+    node_td	*p;
+    int		mid;
+
+    if (lo > hi)
+	return (node_td *) NULL;
+
+    mid = lo + (hi - lo)/2;
+    p = nodes[mid];
+    p->parent = parent;
+    p->index = index;
+    p->size = hi - lo + 1;
+    p->left = BTreeRelinkNodes(nodes, lo, mid-1, p, (2*index)+1);
+    p->right = BTreeRelinkNodes(nodes, mid+1, hi, p, (2*index)+2);
+
+    return p;
+}
+
+/*
+ * rebuild the subtree at <subtree> perfectly balanced, re-using its nodes
+ * (no allocation, node and data pointers stay good), and hang it back in
+ * the same spot
+ */
+static node_td *
+rebuildSubtree(node_td **root, node_td *subtree)
+{
+    node_td	**nodes, *parent, *p;
+    int		count = 0;
+
+    if (subtree == (node_td *) NULL)
+	return (node_td *) NULL;
+
+    nodes = (node_td **) malloc(BTreeCountNodes(subtree) * sizeof(node_td *));
+    BTreeListNodes(subtree, nodes, &count);
+
+    parent = subtree->parent;
+    p = BTreeRelinkNodes(nodes, 0, count-1, parent, subtree->index);
+
+    if (parent == (node_td *) NULL) {
+	*root = p;
+    } else if (parent->left == subtree) {
+	parent->left = p;
+    } else {
+	parent->right = p;
+    }
+
+    free(nodes);
+    return p;
+}
+
 /*
  *
- * Re-balance the tree. Find the median key and make it the root, then rebuild the tree
+ * Re-balance the tree: rebuild the whole thing perfectly balanced
  *
+ * The nodes are re-linked, not re-allocated, so the root may change
+ * but pointers to nodes stay good.
  */
 node_td *
 BTreeRebalance(node_td *root)
 {
-    node_td		*newroot;
-    nodelist_td		*p, *lastp, *mednode;
-    int			i, medkey;
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, root);
 
+    rebuildSubtree(&root, root);
 
-	/* flatten the tree into a linked list */
-    tempNodeList = (nodelist_td *) NULL;
-    buildTempList(root);
+    BTREE_STATS_LATENCY(BTREE_OP_REBALANCE, start);
+    BTREE_TRACE_LEAVE(BTREE_TRACE_REBALANCE, tree, root, 0, 0);
+    return root;
+}
+
+/*
+ * rebalance just the subtree at <subtree> (any node of the tree at <*root>)
+ *
+ * Returns the new top of the subtree (*root changes if <subtree> was the root).
+ */
+node_td *
+BTreeRebalanceSubtree(node_td **root, node_td *subtree)
+{
+    node_td	*p;
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, *root);
 
-	/* find the median key in the list:
-         * choose the node in  the middle of the list 
-         */
-    medkey = tempListLength/2;
-    i = 0;
+    p = rebuildSubtree(root, subtree);
 
-    p = tempNodeList;
-    lastp = (nodelist_td *) NULL;
-    while (p->next != (nodelist_td *) NULL && i<medkey) { 
-	lastp = p;
-        p = p->next;
-	i++;
+    BTREE_STATS_LATENCY(BTREE_OP_REBALANCE, start);
+    if (subtree != (node_td *) NULL) {	/* (its nodes are re-linked, not freed) */
+	BTREE_TRACE_LEAVE(BTREE_TRACE_SUBTREE, tree, *root, subtree->key, 0);
+    } else {
+	BTREE_TRACE_QUIET(tree);
+    }
+    return p;
+}
+
+/* is one side of <p> holding too big a share of its nodes? */
+#define OVERWEIGHT(p)	(BTREE_SIZE((p)->left) > BTREE_REBALANCE_ALPHA * (p)->size || \
+			 BTREE_SIZE((p)->right) > BTREE_REBALANCE_ALPHA * (p)->size)
+
+/* state of one BTreeRebalanceStep() call */
+typedef struct rebalstep_st
+{
+    node_td	**root;
+    long	*cursor;	/* last node checked (top down, in pre-order) */
+    int		budget;		/* work left */
+    int		rebuilt;	/* nodes re-linked so far */
+    int		descended;	/* fixDeepest() has been done this call */
+} rebalstep_td;
+
+/* rebuild subtree <p> out of the budget */
+static void
+rebuildStep(node_td *p, rebalstep_td *st)
+{
+    st->budget -= p->size;
+    st->rebuilt += p->size;
+    rebuildSubtree(st->root, p);
+}
+
+/*
+ * list subtree <p> in key order like BTreeListNodes(), but leave out the
+ * subtree <cut>, just note in <*hole> where it would have been
+ */
+static void
+listAround(node_td *p, node_td *cut, node_td **nodes, int *count, int *hole)
+{
+    if (p == (node_td *) NULL)
+	return;
+    if (p == cut) {
+	*hole = *count;
+	return;
+    }
+
+    listAround(p->left, cut, nodes, count, hole);
+    nodes[(*count)++] = p;
+    listAround(p->right, cut, nodes, count, hole);
+}
+
+/*
+ * rebuild just the top of subtree <p>: the nodes down its heavy side,
+ * with their light sides, as far as the budget goes. What is left of the
+ * heavy side hangs back in where its keys go, which is a free spot at the
+ * bottom of the rebuilt part.
+ */
+static void
+rebuildTop(node_td *p, rebalstep_td *st)
+{
+    node_td	**nodes, *cut, *light, *parent, *top, *q;
+    int		count = 0, hole = 0, n, spine, levels;
+
+    for (cut = p, n = 0, spine = 0; cut != (node_td *) NULL; spine++) {
+	light = (BTREE_SIZE(cut->left) > BTREE_SIZE(cut->right)) ? cut->right : cut->left;
+	if (n + 1 + BTREE_SIZE(light) > st->budget)
+	    break;
+	n += 1 + BTREE_SIZE(light);
+	cut = (light == cut->left) ? cut->right : cut->left;
+    }
+    for (levels = 0; (1 << levels) <= n; levels++)
+	;
+    if (spine <= levels)
+	return;		/* the rest of the heavy side would end up no higher */
+
+    nodes = (node_td **) malloc(n * sizeof(node_td *));
+    listAround(p, cut, nodes, &count, &hole);
+    parent = p->parent;
+    top = BTreeRelinkNodes(nodes, 0, count-1, parent, p->index);
+    replaceChild(st->root, parent, p, top);
+
+    if (cut != (node_td *) NULL) {
+	    /* between two neighbours in key order one of them has a free
+	     * child on the side facing the other
+	     */
+	if (hole > 0 && nodes[hole-1]->right == (node_td *) NULL) {
+	    q = nodes[hole-1];
+	    q->right = cut;
+	} else {
+	    q = nodes[hole];
+	    q->left = cut;
+	}
+	cut->parent = q;
+	for (; q != parent; q = q->parent) {
+	    q->size += cut->size;
+	}
+    }
+
+    st->budget -= count;
+    st->rebuilt += count;
+    free(nodes);
+}
+
+/*
+ * <p> is overweight but too big for the budget: walk down its heavy side
+ * to the biggest subtree we can afford and rebuild that if it's
+ * overweight too. If it isn't, the trouble is the spine above it, so
+ * rebuild the top of <p> instead. Either way a long spine gets shorter.
+ * The walk is one path and isn't charged.
+ */
+static void
+fixDeepest(node_td *p, rebalstep_td *st)
+{
+    node_td	*q;
+
+    st->descended = 1;
+
+    for (q = p; q != (node_td *) NULL && q->size > st->budget; ) {
+	q = (BTREE_SIZE(q->left) > BTREE_SIZE(q->right)) ? q->left : q->right;
+    }
+    if (q != (node_td *) NULL && OVERWEIGHT(q))
+	rebuildStep(q, st);
+    else
+	rebuildTop(p, st);
+}
+
+/*
+ * check subtree <p> top down, so the biggest overweight subtree we can
+ * afford is fixed before anything inside it, as far as the budget goes
+ *
+ * The cursor moves on with each node checked. A rebuilt subtree is done
+ * as a whole: the cursor moves to its biggest key, whose node is the
+ * last one of the new subtree in pre-order.
+ */
+static void
+sweepTree(node_td *p, rebalstep_td *st)
+{
+    node_td	*q;
+
+    if (p == (node_td *) NULL || st->budget <= 0)
+	return;
+
+    if (OVERWEIGHT(p) && p->size <= st->budget) {
+	for (q = p; q->right != (node_td *) NULL; q = q->right)
+	    ;
+	*st->cursor = q->key;
+	rebuildStep(p, st);
+	return;
     }
 
-    mednode = p;
-    newroot = BTreeNewNode(mednode->node->key, NULL, 0, mednode->node->data);
+    st->budget--;
+    *st->cursor = p->key;
+    if (OVERWEIGHT(p) && !st->descended)
+	fixDeepest(p, st);
+
+    sweepTree(p->left, st);
+    sweepTree(p->right, st);
+}
+
+/*
+ * pick the sweep of subtree <p> up after the node with key <cursor>
+ *
+ * Walking down to it is not charged to the budget (it's one path). The
+ * nodes on the path were checked before it, and so were the left sides
+ * we pass on the way; the right sides we pass come after it.
+ */
+static void
+sweepFrom(node_td *p, long cursor, rebalstep_td *st)
+{
+    if (p == (node_td *) NULL)
+	return;
+
+    if (cursor < p->key) {
+	sweepFrom(p->left, cursor, st);
+	sweepTree(p->right, st);
+    } else if (cursor > p->key) {
+	sweepFrom(p->right, cursor, st);
+    } else {
+	sweepTree(p->left, st);
+	sweepTree(p->right, st);
+    }
+}
+
+/*
+ * incremental rebalance: do about <budget> nodes worth of work, then return
+ *
+ * Sweeps the tree top down, picking up where the last call stopped
+ * (<*cursor>, start with BTREE_REBALANCE_START), and rebuilds subtrees
+ * where one side holds more than BTREE_REBALANCE_ALPHA of the nodes
+ * (a "scapegoat"). Checking a node costs 1, rebuilding a subtree costs
+ * its size. A scapegoat bigger than the budget is left for a call with a
+ * bigger budget; meanwhile (once per call) the biggest overweight subtree
+ * we can afford on its heavy side is rebuilt, or if there's none, as much
+ * of the scapegoat's top as we can afford, and the sweep goes on.
+ *
+ * Call it between batches of requests to keep pauses short. The tree
+ * may change between calls.
+ *
+ * Returns the number of nodes rebuilt.
+ */
+int
+BTreeRebalanceStep(node_td **root, long *cursor, int budget)
+{
+    rebalstep_td	st;
+    BTREE_STATS_TIMER(start);
+    BTREE_TRACE_ENTER(tree, *root);
+
+    st.root = root;
+    st.cursor = cursor;
+    st.budget = budget;
+    st.rebuilt = 0;
+    st.descended = 0;
+
+    if (*cursor == BTREE_REBALANCE_START)
+	sweepTree(*root, &st);
+    else
+	sweepFrom(*root, *cursor, &st);
+
+    if (st.budget > 0)	/* got to the end, next call starts over */
+	*cursor = BTREE_REBALANCE_START;
+
+    BTREE_STATS_LATENCY(BTREE_OP_REBALANCE, start);
+    BTREE_TRACE_LEAVE(BTREE_TRACE_STEP, tree, *root, budget, 0);
+    return st.rebuilt;
+}
+
+
+/*
+ * count the nodes in a tree
+ *
+ */
+int
+BTreeCountNodes(node_td *root)
+{
+    if (root == (node_td *) NULL)
+	return 0;
+
+    return 1 + BTreeCountNodes(root->left) + BTreeCountNodes(root->right);
+}
+
+/* recursive helper for BTreeFlatten(), <pos> is the next free array slot */
+static void
+flattenTree(node_td *root, int *keys, void **data, int *pos)
+{
+    if (root == (node_td *) NULL)
+	return;
+
+    flattenTree(root->left, keys, data, pos);
+    keys[*pos] = root->key;
+    if (data != (void **) NULL)
+	data[*pos] = root->data;
+    (*pos)++;
+    flattenTree(root->right, keys, data, pos);
+}
+
+/*
+ * copy the keys (and data pointers, if <data> is not NULL) of a tree
+ * into arrays, in sorted (in-order) order.
+ *
+ * The arrays must hold at least BTreeCountNodes(root) entries.
+ *
+ * Returns the number of entries written.
+ */
+int
+BTreeFlatten(node_td *root, int *keys, void **data)
+{
+    int		pos = 0;
+
+    flattenTree(root, keys, data, &pos);
+    return pos;
+}
+
+/*
+ * recursive helper for BTreeBuildSorted(), node i of the block holds key i
+ * (with <valsize> > 0 data[i] points at the value to copy into it)
+ */
+static node_td *
+buildSorted(node_td *nodes, int *keys, void **data, int valsize, int lo, int hi, node_td *parent, int index)
+{
+    node_td	*p;
+    int		mid;
+
+    if (lo > hi)
+	return (node_td *) NULL;
 
-    if (lastp != (nodelist_td *)NULL) {
-        lastp->next = p->next;	/* remove p from list */
-    } else { /* only one element in temp list */
-        freeTempList();
-        tempNodeList = (nodelist_td *) NULL;
+    mid = lo + (hi - lo)/2;
+    p = BTREE_BLOCK_NODE(nodes, mid, valsize);
+
+    p->key = keys[mid];
+    p->index = index;
+    p->size = hi - lo + 1;
+    if (valsize > 0) {
+	if (data != (void **) NULL && data[mid] != NULL)
+	    memcpy(p->data, data[mid], valsize);
+    } else {
+	p->data = (data != (void **) NULL) ? data[mid] : NULL;
     }
+    p->parent = parent;
+    p->left = buildSorted(nodes, keys, data, valsize, lo, mid-1, p, (2*index)+1);
+    p->right = buildSorted(nodes, keys, data, valsize, mid+1, hi, p, (2*index)+2);
 
-    addTempListToTree(&newroot);
+    return p;
+}
 
-    BTreeFreeTree(root);
-    free(mednode);
-    freeTempList();
+/*
+ * build a perfectly balanced tree from <count> keys (and optional data pointers)
+ * that are already sorted and free of duplicates.
+ *
+ * All the nodes come from one BTreeNewNodeBlock(), so this is O(n) with a
+ * single malloc.
+ *
+ * Returns the new root (NULL if count is 0)
+ */
+node_td *
+BTreeBuildSorted(int *keys, void **data, int count)
+{
+    node_td	*nodes;
 
-    return newroot;
+    if (count <= 0)
+	return (node_td *) NULL;
+
+    nodes = BTreeNewNodeBlock(count);
+    return buildSorted(nodes, keys, data, 0, 0, count-1, (node_td *) NULL, 0);
 }
 
+/*
+ * BTreeBuildSorted() for value nodes: node i gets a copy of the <valsize>
+ * bytes at values[i] (zeros if <values> or values[i] is NULL). The nodes
+ * and their values all come from one BTreeNewValueBlock().
+ *
+ * With <valsize> 0 this is just BTreeBuildSorted(), so code that rebuilds
+ * a tree from BTreeFlatten() output can pass BTreeNodeValueSize(root) and
+ * get the same kind of tree back.
+ */
+node_td *
+BTreeBuildSortedValues(int *keys, void **values, int count, int valsize)
+{
+    node_td	*nodes;
+
+    if (count <= 0)
+	return (node_td *) NULL;
+
+    nodes = BTreeNewValueBlock(count, valsize);
+    return buildSorted(nodes, keys, values, valsize, 0, count-1, (node_td *) NULL, 0);
+}
@@ -8,6 +8,8 @@
 #ifndef __BTREE_H__
 #define __BTREE_H__
 
+#include <limits.h>
+
 /*
  * binary tree node
  *
@@ -16,20 +18,85 @@ typedef struct node_st
 {
     int			key;		/* the sort value */
     int			index;		/* index if the tree were stored in an array (useful for level by level output) */
+    int			refcnt;		/* references held on this node (persistent trees, see btree_snap.c) */
+    int			size;		/* number of nodes in the subtree rooted here (this one included) */
+    int			valsize;	/* size of the value stored inline behind the node (0: plain node, data is just a pointer) */
     void		*data;		/* opaque data pointer to hold whatever you want */
     struct node_st	*left, *right;	/* left and right children */
     struct node_st	*parent;	/* parent of this node (for advanced uses!) */
+    struct nodeblock_st	*block;		/* bulk allocated block this node lives in (NULL if malloc'd by itself) */
 } node_td;
 
+/*
+ * inline values (see BTreeNewValueNode())
+ *
+ * A value node carries a fixed size copy of its value in the same
+ * allocation, right behind the node (rounded up to BTREE_VALUE_ALIGN), and
+ * records its size in p->valsize. The node's data pointer points at the
+ * value, so code that only reads p->data works the same on both kinds of
+ * node.
+ */
+#define BTREE_VALUE_ALIGN	8
+#define BTREE_VALUE_BYTES(valsize)	((valsize) <= 0 ? 0 : \
+				 (((valsize) + BTREE_VALUE_ALIGN-1) & ~(BTREE_VALUE_ALIGN-1)))
+#define BTREE_NODE_BYTES(valsize)	((int) sizeof(node_td) + BTREE_VALUE_BYTES(valsize))
+
+/* node <i> of a block from BTreeNewValueBlock() */
+#define BTREE_BLOCK_NODE(nodes, i, valsize)	\
+	((node_td *) ((char *) (nodes) + (long) (i) * BTREE_NODE_BYTES(valsize)))
+
+/* size of a possibly empty subtree */
+#define BTREE_SIZE(p)	((p) == (node_td *) NULL ? 0 : (p)->size)
+
+/*
+ * rebalance a subtree when one side holds more than this fraction of its nodes
+ * (scapegoat style weight balance, see BTreeRebalanceStep())
+ */
+#define BTREE_REBALANCE_ALPHA	0.7
+
+/* cursor value to start BTreeRebalanceStep() sweeps with */
+#define BTREE_REBALANCE_START	LONG_MIN
+
+/*
+ * header of a block of nodes allocated all at once (see BTreeNewNodeBlock())
+ *
+ * The nodes follow the header in memory (with their inline values, if the
+ * block came from BTreeNewValueBlock()). The block is released when the
+ * last of its nodes has been freed with BTreeFreeNode().
+ */
+typedef struct nodeblock_st
+{
+    long		live;		/* nodes in this block not yet freed */
+    long		count;		/* number of nodes in the block */
+} nodeblock_td;
+
 extern node_td	*BTreeNewNode(int key, node_td *parent, int index, void *data);
+extern node_td	*BTreeNewNodeBlock(int count);
+extern node_td	*BTreeNewValueNode(int key, node_td *parent, int index, const void *value, int valsize);
+extern node_td	*BTreeNewValueBlock(int count, int valsize);
+extern node_td	*BTreeCopyNode(node_td *p);
+extern int	BTreeNodeValueSize(node_td *p);
+extern int	BTreeNodeGetValue(node_td *p, void *value);
+extern void	BTreeNodeSetValue(node_td *p, const void *value);
 extern void	BTreeFreeNode(node_td *node);
 extern node_td	*BTreeFreeTree(node_td *root);
 extern int	BTreeNodeIsLeaf(node_td *p);
 extern node_td	*BTreeInsertNode(node_td *root, int key, node_td *parent, int index, void *data);
+extern node_td	*BTreeInsertValue(node_td *root, int key, const void *value, int valsize);
 extern int	BTreeDeleteNode(node_td **root, int key);
+extern node_td	*BTreeLinkNode(node_td *root, node_td *n);
+extern void	BTreeUnlinkNode(node_td **root, node_td *p);
 extern node_td	*BTreeFindNode(node_td *root, int key);
 extern int	BTreeGetHeight(node_td *root);
 extern node_td	*BTreeRebalance(node_td *root);
+extern void	BTreeListNodes(node_td *p, node_td **nodes, int *count);
+extern node_td	*BTreeRelinkNodes(node_td **nodes, int lo, int hi, node_td *parent, int index);
+extern node_td	*BTreeRebalanceSubtree(node_td **root, node_td *subtree);
+extern int	BTreeRebalanceStep(node_td **root, long *cursor, int budget);
+extern int	BTreeCountNodes(node_td *root);
+extern int	BTreeFlatten(node_td *root, int *keys, void **data);
+extern node_td	*BTreeBuildSorted(int *keys, void **data, int count);
+extern node_td	*BTreeBuildSortedValues(int *keys, void **values, int count, int valsize);
 
 #endif /* __BTREE_H__ */
 
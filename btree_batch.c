@@ -0,0 +1,321 @@
+/*
+ * File:	btree_batch.c
+ *
+ * Insert or delete a whole batch of keys at once.
+ *
+ * Inserting m keys one at a time is m walks down the tree and m mallocs.
+ * Here the batch is sorted and duplicates dropped first, then:
+ *
+ *	- a batch that is big next to the tree is merged with the tree's
+ *	  nodes in key order and everything is re-linked as a balanced tree,
+ *	  O(n + m) for n nodes, no matter how the tree looked before.
+ *
+ *	- a small batch (m log n < n) doesn't touch all n nodes. An
+ *	  insert splits the sorted keys down the tree, each run of new
+ *	  keys going to the subtree it belongs in; a subtree that gets at
+ *	  least as many new keys as it has nodes is merged with them and
+ *	  re-linked balanced instead, at a cost no bigger than the run.
+ *	  So a run of keys past the end of the tree ends up as a balanced
+ *	  subtree, not a chain. O(m log n) all told. A delete takes the
+ *	  nodes out key by key, O(m log n).
+ *
+ * Either way the new nodes all come from one BTreeNewValueBlock() and
+ * the nodes already in the tree are re-used (their data and inline
+ * values, and node pointers held elsewhere, stay good).
+ *
+ * Like BTreeInsertNode(), a key already in the tree is left alone, and
+ * within a batch the first of several equal keys wins. Like
+ * BTreeInsertValue(), with <valsize> > 0 the nodes hold inline values
+ * (see btree.h) and data[i] points at the value to copy; <valsize> has
+ * to match the tree's.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "btree_batch.h"
+#include "btree_trace.h"
+
+/* one key of a batch and where it was in the caller's arrays */
+typedef struct batchkey_st
+{
+    int		key;
+    int		pos;
+} batchkey_td;
+
+/* qsort() order: by key, then by position so the first one comes first */
+static int
+compareBatchKeys(const void *a, const void *b)
+{
+    const batchkey_td	*x = (const batchkey_td *) a;
+    const batchkey_td	*y = (const batchkey_td *) b;
+
+    if (x->key != y->key)
+	return (x->key < y->key) ? -1 : 1;
+    return (x->pos < y->pos) ? -1 : (x->pos > y->pos);
+}
+
+/*
+ * sort a batch of keys and drop the duplicates
+ *
+ * Returns a malloc'd array, <*count> is updated.
+ */
+static batchkey_td *
+sortBatch(int *keys, int *count)
+{
+    batchkey_td	*batch;
+    int		i, n;
+
+    batch = (batchkey_td *) malloc((*count + 1) * sizeof(batchkey_td));
+    for (i=0; i<*count; i++) {
+	batch[i].key = keys[i];
+	batch[i].pos = i;
+    }
+    qsort(batch, *count, sizeof(batchkey_td), compareBatchKeys);
+
+    for (i=0, n=0; i<*count; i++) {
+	if (n == 0 || batch[i].key != batch[n-1].key)
+	    batch[n++] = batch[i];
+    }
+    *count = n;
+    return batch;
+}
+
+/* is a batch of <m> keys small enough to do key by key in a tree of <n>? */
+static int
+smallBatch(int m, int n)
+{
+    int		levels = 1;
+
+    while ((1L << levels) <= n) {
+	levels++;
+    }
+    return (long) m * levels < n;
+}
+
+/*
+ * make the nodes for the <m> keys of <batch>, with their data pointers
+ * (or values of <valsize> bytes) from <data>, all from one block
+ *
+ * Returns a malloc'd array of the nodes, in batch order.
+ */
+static node_td **
+newNodes(batchkey_td *batch, int m, void **data, int valsize)
+{
+    node_td	**nodes, *block, *p;
+    void	*d;
+    int		i;
+
+    block = BTreeNewValueBlock(m, valsize);
+    nodes = (node_td **) malloc((m + 1) * sizeof(node_td *));
+    for (i=0; i<m; i++) {
+	p = BTREE_BLOCK_NODE(block, i, valsize);
+	p->key = batch[i].key;
+	d = (data != (void **) NULL) ? data[batch[i].pos] : NULL;
+	if (valsize > 0) {
+	    if (d != NULL)
+		memcpy(p->data, d, valsize);
+	} else {
+	    p->data = d;
+	}
+	nodes[i] = p;
+    }
+
+    return nodes;
+}
+
+/*
+ * merge the <na> nodes at <a> and the <nb> nodes at <b>, both in key
+ * order, into <out>
+ */
+static void
+mergeNodes(node_td **a, int na, node_td **b, int nb, node_td **out)
+{
+    int		i, j, k;
+
+    for (i=0, j=0, k=0; i<na || j<nb; ) {
+	if (i < na && (j == nb || a[i]->key < b[j]->key))
+	    out[k++] = a[i++];
+	else
+	    out[k++] = b[j++];
+    }
+}
+
+/*
+ * hang the new nodes <nodes>[lo..hi] (in key order, none of them in the
+ * tree yet) into the subtree at <p>, whose parent is <parent> and which
+ * sits at <index>
+ *
+ * The run is split at each node's key on the way down. Where the run is
+ * at least as big as the subtree it lands in, the two are merged and
+ * re-linked balanced, which costs O(run) and keeps the run from growing
+ * a chain.
+ *
+ * Returns the new subtree root.
+ */
+static node_td *
+insertRun(node_td *p, node_td **nodes, int lo, int hi, node_td *parent, int index)
+{
+    node_td	**old, **merged;
+    int		n, m, i, j, mid;
+
+    m = hi - lo + 1;
+    if (m <= 0)
+	return p;
+
+    n = BTREE_SIZE(p);
+    if (m >= n) {
+	old = (node_td **) malloc((n + 1) * sizeof(node_td *));
+	merged = (node_td **) malloc((n + m) * sizeof(node_td *));
+	i = 0;
+	BTreeListNodes(p, old, &i);
+	mergeNodes(old, n, nodes + lo, m, merged);
+	p = BTreeRelinkNodes(merged, 0, n + m - 1, parent, index);
+	free(merged);
+	free(old);
+	return p;
+    }
+
+	/* first of the run that goes right of <p> */
+    for (i=lo, j=hi+1; i<j; ) {
+	mid = i + (j - i)/2;
+	if (nodes[mid]->key < p->key)
+	    i = mid + 1;
+	else
+	    j = mid;
+    }
+
+    p->left = insertRun(p->left, nodes, lo, i-1, p, (2*p->index)+1);
+    p->right = insertRun(p->right, nodes, i, hi, p, (2*p->index)+2);
+    p->size += m;
+
+    return p;
+}
+
+/*
+ * insert <count> keys (and optional data pointers, or values of <valsize>
+ * bytes) into the tree at <root>
+ *
+ * Returns the new root.
+ */
+node_td *
+BTreeBatchInsert(node_td *root, int *keys, void **data, int count, int valsize)
+{
+    batchkey_td	*batch;
+    node_td	**nodes, **fresh, **merged;
+    int		n, i, j, k, m;
+    BTREE_TRACE_ENTER(tree, root);	/* (batches aren't recorded) */
+
+    if (count <= 0) {
+	BTREE_TRACE_QUIET(tree);
+	return root;
+    }
+
+    batch = sortBatch(keys, &count);
+    n = BTREE_SIZE(root);
+
+    if (smallBatch(count, n)) {
+
+	    /* keep just the keys that are new, then split them down the tree */
+	for (i=0, m=0; i<count; i++) {
+	    if (BTreeFindNode(root, batch[i].key) == (node_td *) NULL)
+		batch[m++] = batch[i];
+	}
+	fresh = newNodes(batch, m, data, valsize);
+	root = insertRun(root, fresh, 0, m-1, (node_td *) NULL, 0);
+
+	free(fresh);
+	free(batch);
+	BTREE_TRACE_QUIET(tree);
+	return root;
+    }
+
+	/* big batch: merge the new keys with the tree's nodes in key order */
+    nodes = (node_td **) malloc((n + 1) * sizeof(node_td *));
+    k = 0;
+    BTreeListNodes(root, nodes, &k);
+
+    for (i=0, j=0, m=0; i<count; i++) {		/* keep the new keys only */
+	while (j < n && nodes[j]->key < batch[i].key)
+	    j++;
+	if (j == n || nodes[j]->key != batch[i].key)
+	    batch[m++] = batch[i];
+    }
+
+    fresh = newNodes(batch, m, data, valsize);
+    merged = (node_td **) malloc((n + m + 1) * sizeof(node_td *));
+    mergeNodes(nodes, n, fresh, m, merged);
+    k = n + m;
+    root = BTreeRelinkNodes(merged, 0, k-1, (node_td *) NULL, 0);
+
+    free(merged);
+    free(fresh);
+    free(nodes);
+    free(batch);
+    BTREE_TRACE_QUIET(tree);
+    return root;
+}
+
+/*
+ * delete <count> keys from the tree at <*root> (keys not in the tree are skipped)
+ *
+ * A big batch rebuilds the tree balanced from the nodes that are left,
+ * a small one takes each node out with BTreeUnlinkNode(), one walk down
+ * per key.
+ *
+ * Returns the number of keys deleted.
+ */
+int
+BTreeBatchDelete(node_td **root, int *keys, int count)
+{
+    batchkey_td	*batch;
+    node_td	**nodes, *p;
+    int		n, i, j, k, deleted = 0;
+    BTREE_TRACE_ENTER(tree, *root);
+
+    if (count <= 0 || *root == (node_td *) NULL) {
+	BTREE_TRACE_QUIET(tree);
+	return 0;
+    }
+
+    batch = sortBatch(keys, &count);
+    n = BTREE_SIZE(*root);
+
+    if (smallBatch(count, n)) {
+	for (i=0; i<count; i++) {
+	    p = BTreeFindNode(*root, batch[i].key);
+	    if (p != (node_td *) NULL) {
+		BTreeUnlinkNode(root, p);
+		BTreeFreeNode(p);
+		deleted++;
+	    }
+	}
+	free(batch);
+	BTREE_TRACE_QUIET(tree);
+	return deleted;
+    }
+
+	/* big batch: walk the nodes in key order, keep the ones not in the batch */
+    nodes = (node_td **) malloc((n + 1) * sizeof(node_td *));
+    k = 0;
+    BTreeListNodes(*root, nodes, &k);
+
+    for (i=0, j=0, k=0; j<n; j++) {
+	while (i < count && batch[i].key < nodes[j]->key)
+	    i++;
+	if (i < count && batch[i].key == nodes[j]->key) {
+	    BTreeFreeNode(nodes[j]);
+	    deleted++;
+	} else {
+	    nodes[k++] = nodes[j];
+	}
+    }
+    *root = BTreeRelinkNodes(nodes, 0, k-1, (node_td *) NULL, 0);
+
+    free(nodes);
+    free(batch);
+    BTREE_TRACE_QUIET(tree);
+    return deleted;
+}
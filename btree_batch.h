@@ -0,0 +1,13 @@
+/*
+ * File:	btree_batch.h
+ *
+ * Include file for btree_batch.c, inserting and deleting batches of keys.
+ *
+ */
+#ifndef __BTREE_BATCH_H__
+#define __BTREE_BATCH_H__
+
+extern node_td	*BTreeBatchInsert(node_td *root, int *keys, void **data, int count, int valsize);
+extern int	BTreeBatchDelete(node_td **root, int *keys, int count);
+
+#endif /* __BTREE_BATCH_H__ */
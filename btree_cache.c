@@ -0,0 +1,139 @@
+/*
+ * File:	btree_cache.c
+ *
+ * A small direct-mapped cache of recently found nodes, in front of
+ * BTreeFindNode().
+ *
+ * When a few keys get most of the lookups, walking down from the root
+ * for them every time is a waste: each level is another cache miss.
+ * Here the key is hashed to one slot, and if the slot holds that key we
+ * have the node with a single memory access. Otherwise we search the
+ * tree as usual and remember the node in the slot.
+ *
+ * Inserts and rebalancing never free nodes (rebalancing only re-links
+ * them), so they don't touch the cache and plain BTreeInsertNode() and
+ * BTreeRebalance() calls can be used as is. BTreeDeleteNode() frees the
+ * deleted node (the nodes below it are only moved), so deletes must go
+ * through BTreeCacheDeleteNode(), which drops the slot for that key.
+ * Anything else that frees nodes (BTreeRelayout(), BTreeBatchDelete(),
+ * BTreeFreeTree()) needs a BTreeCacheClear().
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "btree_cache.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+
+/* Fibonacci hashing: spreads consecutive keys over the slots */
+#define CACHE_SLOT(cache, key)	\
+	((unsigned int) ((unsigned int) (key) * 2654435769U) >> (32 - (cache)->bits))
+
+/*
+ * create a cache with <size> slots (rounded up to a power of 2)
+ */
+btreecache_td *
+BTreeCacheNew(int size)
+{
+    btreecache_td	*cache;
+
+    cache = (btreecache_td *) malloc(sizeof(btreecache_td));
+    cache->bits = 1;
+    while ((1 << cache->bits) < size && cache->bits < 30) {
+	cache->bits++;
+    }
+    cache->slots = (cacheslot_td *) calloc(1 << cache->bits, sizeof(cacheslot_td));
+
+    return cache;
+}
+
+void
+BTreeCacheFree(btreecache_td *cache)
+{
+    if (cache == (btreecache_td *) NULL)
+	return;
+
+    free(cache->slots);
+    free(cache);
+}
+
+/*
+ * forget everything
+ */
+void
+BTreeCacheClear(btreecache_td *cache)
+{
+    memset(cache->slots, 0, (1 << cache->bits) * sizeof(cacheslot_td));
+}
+
+/*
+ * forget any nodes with keys in [lokey, hikey]
+ *
+ * Small ranges just hash each key, big ranges sweep the whole cache.
+ */
+void
+BTreeCacheInvalidateRange(btreecache_td *cache, int lokey, int hikey)
+{
+    cacheslot_td	*slot;
+    long		key;
+    int			i, size = 1 << cache->bits;
+
+    if ((long) hikey - (long) lokey < (long) size) {
+	for (key = lokey; key <= hikey; key++) {
+	    slot = &cache->slots[CACHE_SLOT(cache, key)];
+	    if (slot->key == key)
+		slot->node = (node_td *) NULL;
+	}
+    } else {
+	for (i=0; i<size; i++) {
+	    slot = &cache->slots[i];
+	    if (slot->key >= lokey && slot->key <= hikey)
+		slot->node = (node_td *) NULL;
+	}
+    }
+}
+
+/*
+ * BTreeFindNode(), but check the cache first
+ */
+node_td *
+BTreeCacheFindNode(btreecache_td *cache, node_td *root, int key)
+{
+    cacheslot_td	*slot;
+    node_td		*p;
+    BTREE_TRACE_ENTER(tree, root);
+
+    slot = &cache->slots[CACHE_SLOT(cache, key)];
+    if (slot->node != (node_td *) NULL && slot->key == key) {
+	BTREE_STATS_ADD(cachehits, 1);
+	BTREE_TRACE_LEAVE(BTREE_TRACE_FIND, tree, root, key, 1);
+	return slot->node;
+    }
+    BTREE_STATS_ADD(cachemisses, 1);
+
+    p = BTreeFindNode(root, key);
+    if (p != (node_td *) NULL) {
+	slot->key = key;
+	slot->node = p;
+    }
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_FIND, tree, root, key, p != (node_td *) NULL);
+    return p;
+}
+
+/*
+ * BTreeDeleteNode(), keeping the cache correct
+ *
+ * The delete frees just the node holding <key> and re-links the ones
+ * below it, so that's the only slot we drop.
+ */
+int
+BTreeCacheDeleteNode(btreecache_td *cache, node_td **root, int key)
+{
+    BTreeCacheInvalidateRange(cache, key, key);
+
+    return BTreeDeleteNode(root, key);
+}
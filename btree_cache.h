@@ -0,0 +1,30 @@
+/*
+ * File:	btree_cache.h
+ *
+ * Include file for btree_cache.c, a small front cache for hot lookups.
+ *
+ */
+#ifndef __BTREE_CACHE_H__
+#define __BTREE_CACHE_H__
+
+typedef struct cacheslot_st
+{
+    int			key;
+    node_td		*node;		/* NULL if the slot is empty */
+} cacheslot_td;
+
+typedef struct btreecache_st
+{
+    int			bits;		/* log2 of the number of slots */
+    cacheslot_td	*slots;
+} btreecache_td;
+
+extern btreecache_td	*BTreeCacheNew(int size);
+extern void		BTreeCacheFree(btreecache_td *cache);
+extern void		BTreeCacheClear(btreecache_td *cache);
+extern void		BTreeCacheInvalidateRange(btreecache_td *cache, int lokey, int hikey);
+extern node_td		*BTreeCacheFindNode(btreecache_td *cache, node_td *root, int key);
+extern int		BTreeCacheDeleteNode(btreecache_td *cache, node_td **root, int key);
+
+#endif /* __BTREE_CACHE_H__ */
+
@@ -0,0 +1,257 @@
+/*
+ * File:	btree_filter.c
+ *
+ * A counting Bloom filter kept next to a tree, in front of
+ * BTreeFindNode(), so lookups for keys that aren't there can usually
+ * be answered without walking the tree at all.
+ *
+ * A miss in the tree costs a full walk down, a cache miss per level.
+ * The filter answers "definitely not there" or "maybe there" by looking
+ * at BTREE_FILTER_PROBES counters that all sit in one cache line picked
+ * by hashing the key (a "blocked" Bloom filter), so a miss costs one
+ * memory access. "Maybe" goes on to search the tree, which is wrong only
+ * about a fraction of a percent of the time at the default size.
+ *
+ * The counters are 4 bits, so keys can be removed again: inserts and
+ * deletes go through BTreeFilterInsertNode() and BTreeFilterDeleteNode().
+ * A counter that reaches 15 stays there (we no longer know how many
+ * keys share it), which can only make the filter say "maybe" more often.
+ * Rebalancing and re-laying out the tree don't change its keys, so they
+ * don't touch the filter. Anything else that changes the keys (set
+ * operations, BTreeFreeTree(), a plain BTreeInsertNode()) needs a
+ * BTreeFilterBuild().
+ *
+ * Like the tree, the filter does no locking of its own.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "btree_filter.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+
+#define FILTER_MAX	15		/* a stuck counter */
+
+/* bit mixer (the splitmix64 finalizer), every key bit reaches every hash bit */
+static unsigned long
+hashKey(int key)
+{
+    unsigned long	h = (unsigned long) (unsigned int) key;
+
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9UL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebUL;
+    return h ^ (h >> 31);
+}
+
+/*
+ * the block of <key> and the first counter and step for its probes
+ *
+ * The block comes from the low bits of the hash, the counters from the
+ * top bits. An odd step visits BTREE_FILTER_PROBES different counters.
+ */
+static unsigned char *
+keyBlock(btreefilter_td *filter, int key, int *pos, int *step)
+{
+    unsigned long	h = hashKey(key);
+
+    *pos = (int) (h >> 57);
+    *step = (int) ((h >> 50) & (BTREE_FILTER_SLOTS-1)) | 1;
+    return filter->blocks + (h & ((1UL << filter->bits) - 1)) * BTREE_FILTER_LINE;
+}
+
+/* 4 bit counter <i> of a block */
+#define COUNTER(blk, i)		(((blk)[(i) >> 1] >> (((i) & 1) << 2)) & 0xf)
+
+/*
+ * create a filter sized for about <nkeys> keys (16 counters, 8 bytes,
+ * per key; it keeps working with more, it just says "maybe" more often)
+ */
+btreefilter_td *
+BTreeFilterNew(int nkeys)
+{
+    btreefilter_td	*filter;
+    void		*mem;
+
+    filter = (btreefilter_td *) malloc(sizeof(btreefilter_td));
+    filter->bits = 0;
+    while ((1L << filter->bits) * BTREE_FILTER_SLOTS < 16L * nkeys && filter->bits < 30) {
+	filter->bits++;
+    }
+
+    if (posix_memalign(&mem, BTREE_FILTER_LINE, (1L << filter->bits) * BTREE_FILTER_LINE) != 0) {
+	free(filter);
+	return (btreefilter_td *) NULL;
+    }
+    filter->blocks = (unsigned char *) mem;
+    BTreeFilterClear(filter);
+
+    return filter;
+}
+
+void
+BTreeFilterFree(btreefilter_td *filter)
+{
+    if (filter == (btreefilter_td *) NULL)
+	return;
+
+    free(filter->blocks);
+    free(filter);
+}
+
+/*
+ * forget every key
+ */
+void
+BTreeFilterClear(btreefilter_td *filter)
+{
+    memset(filter->blocks, 0, (1L << filter->bits) * BTREE_FILTER_LINE);
+}
+
+/*
+ * count <key> in (a key added twice must be removed twice)
+ */
+void
+BTreeFilterAdd(btreefilter_td *filter, int key)
+{
+    unsigned char	*blk;
+    int			i, pos, step;
+
+    blk = keyBlock(filter, key, &pos, &step);
+    for (i=0; i<BTREE_FILTER_PROBES; i++) {
+	if (COUNTER(blk, pos) != FILTER_MAX)
+	    blk[pos >> 1] += 1 << ((pos & 1) << 2);
+	pos = (pos + step) & (BTREE_FILTER_SLOTS-1);
+    }
+}
+
+/*
+ * count <key> back out (it must have been added)
+ */
+void
+BTreeFilterRemove(btreefilter_td *filter, int key)
+{
+    unsigned char	*blk;
+    int			i, pos, step, c;
+
+    blk = keyBlock(filter, key, &pos, &step);
+    for (i=0; i<BTREE_FILTER_PROBES; i++) {
+	c = COUNTER(blk, pos);
+	if (c != 0 && c != FILTER_MAX)
+	    blk[pos >> 1] -= 1 << ((pos & 1) << 2);
+	pos = (pos + step) & (BTREE_FILTER_SLOTS-1);
+    }
+}
+
+/*
+ * could <key> be in the tree?
+ *
+ * Returns FALSE if it definitely isn't, TRUE if it may be.
+ */
+int
+BTreeFilterMayContain(btreefilter_td *filter, int key)
+{
+    unsigned char	*blk;
+    int			i, pos, step;
+
+    blk = keyBlock(filter, key, &pos, &step);
+    for (i=0; i<BTREE_FILTER_PROBES; i++) {
+	if (COUNTER(blk, pos) == 0)
+	    return 0;
+	pos = (pos + step) & (BTREE_FILTER_SLOTS-1);
+    }
+    return 1;
+}
+
+/* add every key of a subtree */
+static void
+addTree(btreefilter_td *filter, node_td *p)
+{
+    if (p == (node_td *) NULL)
+	return;
+
+    addTree(filter, p->left);
+    BTreeFilterAdd(filter, p->key);
+    addTree(filter, p->right);
+}
+
+/*
+ * start over with exactly the keys of the tree at <root>
+ */
+void
+BTreeFilterBuild(btreefilter_td *filter, node_td *root)
+{
+    BTreeFilterClear(filter);
+    addTree(filter, root);
+}
+
+/*
+ * BTreeFindNode(), but ask the filter first
+ */
+node_td *
+BTreeFilterFindNode(btreefilter_td *filter, node_td *root, int key)
+{
+    node_td	*p;
+    BTREE_TRACE_ENTER(tree, root);
+
+    if (!BTreeFilterMayContain(filter, key)) {
+	BTREE_STATS_ADD(filtered, 1);
+	BTREE_TRACE_LEAVE(BTREE_TRACE_FIND, tree, root, key, 0);
+	return (node_td *) NULL;
+    }
+
+    p = BTreeFindNode(root, key);
+    if (p == (node_td *) NULL) {
+	BTREE_STATS_ADD(filterfalse, 1);
+    }
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_FIND, tree, root, key, p != (node_td *) NULL);
+    return p;
+}
+
+/*
+ * BTreeInsertNode(), keeping the filter up to date
+ *
+ * (a key that was already there doesn't grow the tree, and isn't counted twice)
+ */
+node_td *
+BTreeFilterInsertNode(btreefilter_td *filter, node_td *root, int key, void *data)
+{
+    int		size = BTREE_SIZE(root);
+
+    root = BTreeInsertNode(root, key, root, 0, data);
+    if (BTREE_SIZE(root) != size)
+	BTreeFilterAdd(filter, key);
+
+    return root;
+}
+
+/*
+ * BTreeInsertValue(), keeping the filter up to date
+ */
+node_td *
+BTreeFilterInsertValue(btreefilter_td *filter, node_td *root, int key, const void *value, int valsize)
+{
+    int		size = BTREE_SIZE(root);
+
+    root = BTreeInsertValue(root, key, value, valsize);
+    if (BTREE_SIZE(root) != size)
+	BTreeFilterAdd(filter, key);
+
+    return root;
+}
+
+/*
+ * BTreeDeleteNode(), keeping the filter up to date
+ */
+int
+BTreeFilterDeleteNode(btreefilter_td *filter, node_td **root, int key)
+{
+    if (!BTreeDeleteNode(root, key))
+	return 0;
+
+    BTreeFilterRemove(filter, key);
+    return 1;
+}
@@ -0,0 +1,32 @@
+/*
+ * File:	btree_filter.h
+ *
+ * Include file for btree_filter.c, a counting Bloom filter for fast misses.
+ *
+ */
+#ifndef __BTREE_FILTER_H__
+#define __BTREE_FILTER_H__
+
+#define BTREE_FILTER_LINE	64	/* bytes per block: one cache line */
+#define BTREE_FILTER_SLOTS	(2*BTREE_FILTER_LINE)	/* 4 bit counters per block */
+#define BTREE_FILTER_PROBES	6	/* counters per key, all in its block */
+
+typedef struct btreefilter_st
+{
+    int			bits;		/* log2 of the number of blocks */
+    unsigned char	*blocks;	/* BTREE_FILTER_LINE bytes each, cache line aligned */
+} btreefilter_td;
+
+extern btreefilter_td	*BTreeFilterNew(int nkeys);
+extern void		BTreeFilterFree(btreefilter_td *filter);
+extern void		BTreeFilterClear(btreefilter_td *filter);
+extern void		BTreeFilterAdd(btreefilter_td *filter, int key);
+extern void		BTreeFilterRemove(btreefilter_td *filter, int key);
+extern int		BTreeFilterMayContain(btreefilter_td *filter, int key);
+extern void		BTreeFilterBuild(btreefilter_td *filter, node_td *root);
+extern node_td		*BTreeFilterFindNode(btreefilter_td *filter, node_td *root, int key);
+extern node_td		*BTreeFilterInsertNode(btreefilter_td *filter, node_td *root, int key, void *data);
+extern node_td		*BTreeFilterInsertValue(btreefilter_td *filter, node_td *root, int key, const void *value, int valsize);
+extern int		BTreeFilterDeleteNode(btreefilter_td *filter, node_td **root, int key);
+
+#endif /* __BTREE_FILTER_H__ */
@@ -0,0 +1,201 @@
+/*
+ * File:	btree_finger.c
+ *
+ * Finger search: start looking for a key from a node we already have
+ * (the "finger") instead of from the root.
+ *
+ * When keys are looked up or inserted in sorted order, the next key is
+ * almost always close to the last one. We climb from the finger using the
+ * parent pointers only until we reach a subtree that has to contain the
+ * key, then go back down. For nearby keys that's a few levels instead of
+ * a full walk from the root.
+ *
+ * A node's subtree covers the keys between its nearest ancestors on either
+ * side: if we are a right child our parent's key is the lower bound, if we
+ * are a left child it's the upper bound. So while climbing we can stop as
+ * soon as the parent we would climb to is on the far side of the key.
+ *
+ * The finger is updated to the last node visited (the node found, or the
+ * node where the key would hang) so a loop can just keep passing it in:
+ *
+ *	finger = root;
+ *	for (i=0; i<n; i++)
+ *	    p = BTreeFingerFindNode(&finger, keys[i]);
+ *
+ * A finger is invalid once BTreeDeleteNode() has deleted its node, and
+ * after BTreeRelayout() (nodes get copied). Fingers don't work on
+ * persistent trees (no parent pointers).
+ *
+ * Finger inserts don't keep the subtree sizes up to date: that would be a
+ * walk up to the root for every insert, which is just what the finger
+ * saves us. After a run of finger inserts, and before anything that uses
+ * the sizes (batches, set operations, rebalancing, sharding), hand the
+ * keys that went in to BTreeFingerFixSizes(). It only visits the paths
+ * down to those keys, which for m sorted keys in a tree of n is about
+ * m log(n/m) nodes, the same as the inserts themselves.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "btree.h"
+#include "btree_finger.h"
+#include "btree_stats.h"
+
+/*
+ * climb from <p> until <key> has to be in p's subtree (or p is the root)
+ */
+static node_td *
+climb(node_td *p, int key, int *levels)
+{
+    node_td	*parent;
+
+    while ((parent = p->parent) != (node_td *) NULL && key != p->key) {
+	if (key < p->key && p == parent->right && key > parent->key)
+	    break;	/* between our lower bound and us */
+	if (key > p->key && p == parent->left && key < parent->key)
+	    break;	/* between us and our upper bound */
+	p = parent;
+	(*levels)++;
+    }
+    return p;
+}
+
+/*
+ * find <key> starting from the node <*finger>
+ *
+ * Returns the node (NULL if not found), and leaves <*finger> at the last
+ * node visited.
+ */
+node_td *
+BTreeFingerFindNode(node_td **finger, int key)
+{
+    node_td	*p, *last;
+    int		levels = 0;
+
+    if (*finger == (node_td *) NULL)
+	return (node_td *) NULL;
+
+    p = climb(*finger, key, &levels);
+    last = p;
+
+    while (p != (node_td *) NULL) {
+	levels++;
+	last = p;
+	if (key == p->key)
+	    break;
+	p = (key < p->key) ? p->left : p->right;
+    }
+
+    BTREE_STATS_LOOKUP(levels, 2*levels);
+    *finger = last;
+    return p;
+}
+
+/*
+ * the finger insert, with a data pointer or a copy of a <valsize> byte value
+ */
+static node_td *
+fingerInsert(node_td *root, node_td **finger, int key, const void *data, int valsize)
+{
+    node_td	*p, *parent;
+    int		levels = 0;
+
+    if (root == (node_td *) NULL) {
+	*finger = BTreeNewValueNode(key, (node_td *) NULL, 0, data, valsize);
+	return *finger;
+    }
+
+    p = climb((*finger != (node_td *) NULL) ? *finger : root, key, &levels);
+
+    for (;;) {
+	levels++;
+	if (key == p->key) {
+	    break;		/* duplicate, ignore */
+	}
+	parent = p;
+	if (key < p->key) {
+	    p = p->left;
+	    if (p == (node_td *) NULL) {
+		p = BTreeNewValueNode(key, parent, (2*parent->index)+1, data, valsize);
+		parent->left = p;
+		break;
+	    }
+	} else {
+	    p = p->right;
+	    if (p == (node_td *) NULL) {
+		p = BTreeNewValueNode(key, parent, (2*parent->index)+2, data, valsize);
+		parent->right = p;
+		break;
+	    }
+	}
+    }
+
+    BTREE_STATS_LOOKUP(levels, 2*levels);
+    *finger = p;
+    return root;
+}
+
+/*
+ * insert <key> starting from the node <*finger> (or the root, if the
+ * finger is NULL)
+ *
+ * Duplicates are ignored, as in BTreeInsertNode(). Returns the root (new
+ * only if the tree was empty), and leaves <*finger> at the node with <key>.
+ * The sizes of the new node's ancestors are left stale, see
+ * BTreeFingerFixSizes().
+ */
+node_td *
+BTreeFingerInsertNode(node_td *root, node_td **finger, int key, void *data)
+{
+    return fingerInsert(root, finger, key, data, 0);
+}
+
+/*
+ * BTreeFingerInsertNode() for a tree of inline values (see btree.h): the
+ * new node holds a copy of the <valsize> bytes at <value>
+ */
+node_td *
+BTreeFingerInsertValue(node_td *root, node_td **finger, int key, const void *value, int valsize)
+{
+    return fingerInsert(root, finger, key, value, valsize);
+}
+
+/*
+ * recount the subtree sizes on the paths from <p> down to the sorted keys
+ * keys[lo..hi], the rest of the tree is left alone
+ */
+static int
+fixSizes(node_td *p, int *keys, int lo, int hi)
+{
+    int		i, j, mid, split;
+
+    if (p == (node_td *) NULL)
+	return 0;
+    if (lo > hi)
+	return p->size;
+
+    for (i=lo, j=hi+1; i<j; ) {		/* first key not below p's */
+	mid = i + (j - i)/2;
+	if (keys[mid] < p->key)
+	    i = mid + 1;
+	else
+	    j = mid;
+    }
+    split = i;
+    while (i <= hi && keys[i] == p->key)
+	i++;
+
+    p->size = 1 + fixSizes(p->left, keys, lo, split-1) + fixSizes(p->right, keys, i, hi);
+    return p->size;
+}
+
+/*
+ * bring the subtree sizes up to date after finger inserts of the <count>
+ * keys at <keys> (sorted, keys that were already there don't hurt)
+ */
+void
+BTreeFingerFixSizes(node_td *root, int *keys, int count)
+{
+    fixSizes(root, keys, 0, count-1);
+}
@@ -0,0 +1,16 @@
+/*
+ * File:	btree_finger.h
+ *
+ * Include file for btree_finger.c, searching from a node we already have.
+ *
+ */
+#ifndef __BTREE_FINGER_H__
+#define __BTREE_FINGER_H__
+
+extern node_td	*BTreeFingerFindNode(node_td **finger, int key);
+extern node_td	*BTreeFingerInsertNode(node_td *root, node_td **finger, int key, void *data);
+extern node_td	*BTreeFingerInsertValue(node_td *root, node_td **finger, int key, const void *value, int valsize);
+extern void	BTreeFingerFixSizes(node_td *root, int *keys, int count);
+
+#endif /* __BTREE_FINGER_H__ */
+
@@ -0,0 +1,357 @@
+/*
+ * File:	btree_ingest.c
+ *
+ * Buffered write path for insert bursts (LSM style).
+ *
+ * Instead of a descent and a malloc on the caller's thread for every
+ * insert, writes are appended to a small buffer, which is O(1). When the
+ * buffer fills up it is handed to a background thread, which sorts it and
+ * merges it into the tree (using finger inserts, so each key starts from
+ * a nearby one instead of the root). Meanwhile writers fill
+ * the other buffer. Writers only wait if they fill a buffer before the
+ * previous one has been merged.
+ *
+ * Lookups look at the newest data first: the active buffer, then the
+ * buffer being merged, then the tree.
+ *
+ * Unlike BTreeInsertNode(), inserting a key that is already there
+ * replaces its data: the newest write wins.
+ *
+ * Only trees of data pointers are buffered: a write holds on to the
+ * caller's pointer until it is merged, which would be no good for a tree
+ * of inline values (see btree.h), so BTreeIngestNew() refuses those.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btree.h"
+#include "btree_finger.h"
+#include "btree_ingest.h"
+#include "btree_trace.h"
+
+/* merged ops applied per hold of the tree lock, so lookups don't wait long */
+#define INGEST_CHUNK	64
+
+/* sort by key, then by age */
+static int
+compareOps(const void *a, const void *b)
+{
+    const ingestop_td	*x = (const ingestop_td *) a, *y = (const ingestop_td *) b;
+
+    if (x->key != y->key)
+	return (x->key < y->key) ? -1 : 1;
+    return x->seq - y->seq;
+}
+
+/* let lookups in every so often while merging */
+static void
+mergeYield(btreeingest_td *in, int *applied)
+{
+    if (++(*applied) % INGEST_CHUNK == 0) {
+	pthread_rwlock_unlock(&in->treelock);
+	pthread_rwlock_wrlock(&in->treelock);
+    }
+}
+
+/*
+ * insert sorted ops[lo..hi] median first, then each half the same way.
+ *
+ * Inserting a sorted run one after the other would hang it off the tree as
+ * a long chain; median first keeps the new keys balanced among themselves.
+ * The median's node is a close finger for both halves.
+ */
+static void
+mergeInserts(btreeingest_td *in, ingestop_td *ops, int lo, int hi, node_td *finger, int *applied)
+{
+    int		mid;
+
+    if (lo > hi)
+	return;
+
+    mid = lo + (hi - lo)/2;
+    in->root = BTreeFingerInsertNode(in->root, &finger, ops[mid].key, ops[mid].data);
+    finger->data = ops[mid].data;		/* newest write wins */
+    mergeYield(in, applied);
+
+    mergeInserts(in, ops, lo, mid-1, finger, applied);
+    mergeInserts(in, ops, mid+1, hi, finger, applied);
+}
+
+/*
+ * apply a sorted buffer to the tree, only the newest op for each key counts
+ *
+ * Deletes go first (they free nodes, which could spoil our fingers),
+ * then the inserts. Each key has one op left, so the order doesn't matter.
+ *
+ * Only the merge thread changes the tree, so fingers stay good while we
+ * let go of the lock for lookups.
+ */
+static void
+mergeOps(btreeingest_td *in, ingestop_td *ops, int count)
+{
+    int		*keys, i, n, applied = 0;
+
+    keys = (int *) malloc((count + 1) * sizeof(int));
+    for (i=0, n=0; i<count; i++) {
+	if (i+1 < count && ops[i+1].key == ops[i].key)
+	    continue;		/* overwritten by a newer op */
+	ops[n++] = ops[i];
+    }
+
+    pthread_rwlock_wrlock(&in->treelock);
+
+    for (i=0, count=0; i<n; i++) {
+	if (ops[i].op == BTREE_INGEST_DELETE) {
+	    BTreeDeleteNode(&in->root, ops[i].key);
+	    mergeYield(in, &applied);
+	} else {
+	    ops[count++] = ops[i];	/* keep the inserts, still sorted */
+	}
+    }
+    mergeInserts(in, ops, 0, count-1, in->root, &applied);
+
+    for (i=0; i<count; i++) {	/* finger inserts leave the sizes to us */
+	keys[i] = ops[i].key;
+    }
+    BTreeFingerFixSizes(in->root, keys, count);
+
+    pthread_rwlock_unlock(&in->treelock);
+    free(keys);
+}
+
+/*
+ * the background merge thread
+ */
+static void *
+mergeThread(void *arg)
+{
+    btreeingest_td	*in = (btreeingest_td *) arg;
+    int			count;
+    BTREE_TRACE_ENTER(tree, in->root);	/* the merges aren't recorded */
+
+    pthread_mutex_lock(&in->lock);
+    for (;;) {
+	while (in->nmerging == 0 && !in->stop) {
+	    pthread_cond_wait(&in->wake, &in->lock);
+	}
+	if (in->nmerging == 0)
+	    break;		/* stopping, and nothing left to do */
+
+	    /* the merging buffer doesn't change until we release it */
+	count = in->nmerging;
+	pthread_mutex_unlock(&in->lock);
+
+	memcpy(in->sorted, in->merging, count * sizeof(ingestop_td));
+	qsort(in->sorted, count, sizeof(ingestop_td), compareOps);
+	mergeOps(in, in->sorted, count);
+
+	pthread_mutex_lock(&in->lock);
+	in->nmerging = 0;
+	pthread_cond_broadcast(&in->drained);
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    BTREE_TRACE_QUIET(tree);
+    return NULL;
+}
+
+/*
+ * hand the active buffer to the merge thread (caller holds the lock),
+ * waiting for the previous one to be merged first
+ */
+static void
+swapBuffers(btreeingest_td *in)
+{
+    ingestop_td		*tmp;
+
+    while (in->nmerging != 0) {
+	pthread_cond_wait(&in->drained, &in->lock);
+    }
+    if (in->nactive == 0)
+	return;		/* someone else swapped while we waited */
+
+    tmp = in->merging;
+    in->merging = in->active;
+    in->nmerging = in->nactive;
+    in->active = tmp;
+    in->nactive = 0;
+
+    pthread_cond_signal(&in->wake);
+}
+
+/*
+ * start buffering writes for the tree <root> (may be NULL), with
+ * buffers of <bufsize> writes
+ *
+ * The tree belongs to the ingest thread until BTreeIngestFree().
+ *
+ * Returns NULL if <root> is a tree of inline values.
+ */
+btreeingest_td *
+BTreeIngestNew(node_td *root, int bufsize)
+{
+    btreeingest_td	*in;
+
+    if (BTreeNodeValueSize(root) > 0)
+	return (btreeingest_td *) NULL;
+
+    if (bufsize < 1)
+	bufsize = 1;
+
+    in = (btreeingest_td *) malloc(sizeof(btreeingest_td));
+    pthread_mutex_init(&in->lock, NULL);
+    pthread_cond_init(&in->wake, NULL);
+    pthread_cond_init(&in->drained, NULL);
+    pthread_rwlock_init(&in->treelock, NULL);
+    in->root = root;
+    in->bufsize = bufsize;
+    in->active = (ingestop_td *) malloc(bufsize * sizeof(ingestop_td));
+    in->merging = (ingestop_td *) malloc(bufsize * sizeof(ingestop_td));
+    in->sorted = (ingestop_td *) malloc(bufsize * sizeof(ingestop_td));
+    in->nactive = 0;
+    in->nmerging = 0;
+    in->stop = 0;
+
+    pthread_create(&in->thread, NULL, mergeThread, in);
+
+    return in;
+}
+
+/*
+ * merge everything, stop the merge thread and hand back the tree
+ */
+node_td *
+BTreeIngestFree(btreeingest_td *in)
+{
+    node_td	*root;
+
+    BTreeIngestFlush(in);
+
+    pthread_mutex_lock(&in->lock);
+    in->stop = 1;
+    pthread_cond_signal(&in->wake);
+    pthread_mutex_unlock(&in->lock);
+    pthread_join(in->thread, NULL);
+
+    root = in->root;
+
+    pthread_mutex_destroy(&in->lock);
+    pthread_cond_destroy(&in->wake);
+    pthread_cond_destroy(&in->drained);
+    pthread_rwlock_destroy(&in->treelock);
+    free(in->active);
+    free(in->merging);
+    free(in->sorted);
+    free(in);
+
+    return root;
+}
+
+/* buffer one write */
+static void
+addOp(btreeingest_td *in, int op, int key, void *data)
+{
+    ingestop_td		*p;
+
+    pthread_mutex_lock(&in->lock);
+
+	/* swapBuffers() lets go of the lock while it waits, so other
+	 * writers may have filled the buffer again by the time we're back
+	 */
+    while (in->nactive == in->bufsize) {
+	swapBuffers(in);
+    }
+
+    p = &in->active[in->nactive];
+    p->op = op;
+    p->key = key;
+    p->seq = in->nactive;
+    p->data = data;
+    in->nactive++;
+
+    if (in->nactive == in->bufsize)
+	swapBuffers(in);
+
+    pthread_mutex_unlock(&in->lock);
+}
+
+void
+BTreeIngestInsert(btreeingest_td *in, int key, void *data)
+{
+    addOp(in, BTREE_INGEST_INSERT, key, data);
+}
+
+void
+BTreeIngestDelete(btreeingest_td *in, int key)
+{
+    addOp(in, BTREE_INGEST_DELETE, key, NULL);
+}
+
+/* newest op for <key> in a buffer, NULL if none */
+static ingestop_td *
+findOp(ingestop_td *ops, int count, int key)
+{
+    int		i;
+
+    for (i=count-1; i>=0; i--) {
+	if (ops[i].key == key)
+	    return &ops[i];
+    }
+    return (ingestop_td *) NULL;
+}
+
+/*
+ * look up <key>: buffered writes first, then the tree
+ *
+ * Returns TRUE if found, with its data in <*data> (if data isn't NULL).
+ */
+int
+BTreeIngestFind(btreeingest_td *in, int key, void **data)
+{
+    ingestop_td		*op;
+    node_td		*p;
+    int			found;
+    BTREE_TRACE_ENTER(tree, in->root);	/* (buffered ingest isn't recorded) */
+
+    pthread_mutex_lock(&in->lock);
+    op = findOp(in->active, in->nactive, key);
+    if (op == (ingestop_td *) NULL)
+	op = findOp(in->merging, in->nmerging, key);
+    if (op != (ingestop_td *) NULL) {
+	found = (op->op == BTREE_INGEST_INSERT);
+	if (found && data != (void **) NULL)
+	    *data = op->data;
+	pthread_mutex_unlock(&in->lock);
+	BTREE_TRACE_QUIET(tree);
+	return found;
+    }
+    pthread_mutex_unlock(&in->lock);
+
+    pthread_rwlock_rdlock(&in->treelock);
+    p = BTreeFindNode(in->root, key);
+    found = (p != (node_td *) NULL);
+    if (found && data != (void **) NULL)
+	*data = p->data;
+    pthread_rwlock_unlock(&in->treelock);
+
+    BTREE_TRACE_QUIET(tree);
+    return found;
+}
+
+/*
+ * wait until every buffered write is in the tree
+ */
+void
+BTreeIngestFlush(btreeingest_td *in)
+{
+    pthread_mutex_lock(&in->lock);
+    swapBuffers(in);
+    while (in->nmerging != 0) {
+	pthread_cond_wait(&in->drained, &in->lock);
+    }
+    pthread_mutex_unlock(&in->lock);
+}
+
@@ -0,0 +1,57 @@
+/*
+ * File:	btree_ingest.h
+ *
+ * Include file for btree_ingest.c, buffered inserts/deletes merged into
+ * the tree by a background thread.
+ *
+ */
+#ifndef __BTREE_INGEST_H__
+#define __BTREE_INGEST_H__
+
+#include <pthread.h>
+
+/* a buffered write */
+typedef struct ingestop_st
+{
+    int			op;		/* BTREE_INGEST_INSERT or BTREE_INGEST_DELETE */
+    int			key;
+    int			seq;		/* order within the buffer, newest wins */
+    void		*data;
+} ingestop_td;
+
+#define BTREE_INGEST_INSERT	1
+#define BTREE_INGEST_DELETE	2
+
+typedef struct btreeingest_st
+{
+    pthread_mutex_t	lock;		/* protects the buffers */
+    pthread_cond_t	wake;		/* merge thread: a buffer is ready (or stop) */
+    pthread_cond_t	drained;	/* writers: the merge buffer is free again */
+    pthread_rwlock_t	treelock;	/* lookups read the tree, the merge thread writes it */
+    node_td		*root;
+    int			bufsize;
+    ingestop_td		*active;	/* writes go here */
+    int			nactive;
+    ingestop_td		*merging;	/* full buffer being merged (still searched by lookups) */
+    int			nmerging;
+    ingestop_td		*sorted;	/* merge thread's sorted copy of merging */
+    int			stop;
+    pthread_t		thread;
+} btreeingest_td;
+
+/*
+ * The write that fills the active buffer hands it to the merge thread
+ * then and there. If the previous buffer is still being merged, that
+ * writer (and every writer behind it) blocks until the merge is done, so
+ * pick <bufsize> big enough that a merge takes less time than filling a
+ * buffer.
+ */
+extern btreeingest_td	*BTreeIngestNew(node_td *root, int bufsize);
+extern node_td		*BTreeIngestFree(btreeingest_td *in);
+extern void		BTreeIngestInsert(btreeingest_td *in, int key, void *data);
+extern void		BTreeIngestDelete(btreeingest_td *in, int key);
+extern int		BTreeIngestFind(btreeingest_td *in, int key, void **data);
+extern void		BTreeIngestFlush(btreeingest_td *in);
+
+#endif /* __BTREE_INGEST_H__ */
+
@@ -0,0 +1,236 @@
+/*
+ * File:	btree_interval.c
+ *
+ * Interval trees: each node holds an interval [key, end] (keyed by its
+ * start, so starts are unique like any key) and the biggest end point
+ * in its subtree. A query can then skip every subtree whose biggest end
+ * lies before the range it asks about, and everything right of a start
+ * past the range, instead of scanning all the intervals.
+ *
+ *	root = BTreeIntervalInsert(root, start, end, data);
+ *	BTreeIntervalStab(root, t, fn, arg);		intervals holding t
+ *	BTreeIntervalOverlap(root, lo, hi, fn, arg);	intervals meeting [lo, hi]
+ *	BTreeIntervalDelete(&root, start);
+ *	root = BTreeIntervalRebalance(root);
+ *
+ * The interval lives in the node as an inline value (a btreeinterval_td,
+ * see btree.h), so a query reads end points without leaving the node.
+ * An insert hangs in the new node itself and fixes the max end points on
+ * its way back up; the other calls use the plain tree code and then fix
+ * the max end points of just the nodes it may have moved. Anything else
+ * that reshapes the tree (BTreeRebalanceStep(), set operations) needs a
+ * BTreeIntervalFix() afterwards; BTreeFindNode(), traversals and
+ * BTreeRelayout() work as is.
+ *
+ * Queries cost O(k log n) for k answers in a balanced tree of n
+ * intervals: each answer may take its own walk down. The O(log n + k)
+ * bound of the textbook structures needs a differently built tree (a
+ * priority search tree, or intervals stored at the node they span), not
+ * a tree keyed on the start like this one, which every other btree call
+ * can work on. Stabbing is the same walk with lo == hi.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "btree.h"
+#include "btree_interval.h"
+#include "btree_trace.h"
+
+/* recompute the max end of <p> from its own end and its children's */
+static void
+fixNode(node_td *p)
+{
+    btreeinterval_td	*iv = BTREE_INTERVAL(p);
+
+    iv->maxend = iv->end;
+    if (p->left != (node_td *) NULL && BTREE_INTERVAL(p->left)->maxend > iv->maxend)
+	iv->maxend = BTREE_INTERVAL(p->left)->maxend;
+    if (p->right != (node_td *) NULL && BTREE_INTERVAL(p->right)->maxend > iv->maxend)
+	iv->maxend = BTREE_INTERVAL(p->right)->maxend;
+}
+
+/* fix <p> and everything above it */
+static void
+fixPath(node_td *p)
+{
+    for (; p != (node_td *) NULL; p = p->parent) {
+	fixNode(p);
+    }
+}
+
+/*
+ * recompute the max end points of a whole (sub)tree, bottom up
+ */
+void
+BTreeIntervalFix(node_td *root)
+{
+    if (root == (node_td *) NULL)
+	return;
+
+    BTreeIntervalFix(root->left);
+    BTreeIntervalFix(root->right);
+    fixNode(root);
+}
+
+/*
+ * insert the interval [start, end] (a start already in the tree is ignored)
+ *
+ * Returns the new root.
+ */
+node_td *
+BTreeIntervalInsert(node_td *root, int start, int end, void *data)
+{
+    btreeinterval_td	iv, *piv;
+    node_td		*p, *parent = (node_td *) NULL;
+    int			index = 0;
+    BTREE_TRACE_ENTER(tree, root);
+
+	/* one walk down to the spot for <start> */
+    for (p = root; p != (node_td *) NULL; ) {
+	if (start == p->key) {
+	    BTREE_TRACE_LEAVE(BTREE_TRACE_INSERT, tree, root, start, 0);
+	    return root;
+	}
+	parent = p;
+	if (start < p->key) {
+	    index = (2*p->index)+1;
+	    p = p->left;
+	} else {
+	    index = (2*p->index)+2;
+	    p = p->right;
+	}
+    }
+
+    iv.end = end;
+    iv.maxend = end;
+    iv.data = data;
+    p = BTreeNewValueNode(start, parent, index, &iv, sizeof(iv));
+
+    if (parent == (node_td *) NULL) {
+	root = p;
+    } else if (start < parent->key) {
+	parent->left = p;
+    } else {
+	parent->right = p;
+    }
+
+	/* and back up: only the new node's ancestors grow or get a new max end */
+    for (p = parent; p != (node_td *) NULL; p = p->parent) {
+	p->size++;
+	piv = BTREE_INTERVAL(p);
+	if (end > piv->maxend)
+	    piv->maxend = end;
+    }
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_INSERT, tree, root, start, 0);
+    return root;
+}
+
+/*
+ * delete the interval starting at <start>
+ *
+ * BTreeDeleteNode() re-links the nodes below the deleted one, but their
+ * keys all fall between the deleted node's parent and its next ancestor
+ * on the other side, so they all land back in the spot below the parent
+ * where the deleted node was. We rebuild the max end points there and up
+ * from the parent.
+ *
+ * Returns TRUE if it was there.
+ */
+int
+BTreeIntervalDelete(node_td **root, int start)
+{
+    node_td	*p, *parent;
+    BTREE_TRACE_ENTER(tree, *root);
+
+    p = BTreeFindNode(*root, start);
+    if (p == (node_td *) NULL) {
+	BTREE_TRACE_LEAVE(BTREE_TRACE_DELETE, tree, *root, start, 0);
+	return 0;
+    }
+
+    parent = p->parent;
+    BTreeDeleteNode(root, start);
+
+    if (parent == (node_td *) NULL) {
+	BTreeIntervalFix(*root);
+    } else {
+	BTreeIntervalFix((start < parent->key) ? parent->left : parent->right);
+	fixPath(parent);
+    }
+    BTREE_TRACE_LEAVE(BTREE_TRACE_DELETE, tree, *root, start, 1);
+    return 1;
+}
+
+/*
+ * BTreeRebalance() and the max end points with it
+ */
+node_td *
+BTreeIntervalRebalance(node_td *root)
+{
+    BTREE_TRACE_ENTER(tree, root);
+
+    root = BTreeRebalance(root);
+    BTreeIntervalFix(root);
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_REBALANCE, tree, root, 0, 0);
+    return root;
+}
+
+/* query helper: report the intervals of <p> that meet [lo, hi], in start order */
+static int
+overlap(node_td *p, int lo, int hi, intervalscan_fn fn, void *arg)
+{
+    btreeinterval_td	*iv;
+    int			found = 0;
+
+    while (p != (node_td *) NULL) {
+	iv = BTREE_INTERVAL(p);
+	if (iv->maxend < lo)
+	    break;		/* everything here ends before the range */
+
+	if (p->key > hi) {
+	    p = p->left;	/* this one and the right side start after the range */
+	    continue;
+	}
+
+	found += overlap(p->left, lo, hi, fn, arg);
+
+	if (iv->end >= lo) {
+	    if (fn != (intervalscan_fn) NULL)
+		(*fn)(p->key, iv->end, iv->data, arg);
+	    found++;
+	}
+	p = p->right;
+    }
+
+    return found;
+}
+
+/*
+ * call <fn> for every interval that overlaps [lo, hi] (end points count),
+ * in order of their start
+ *
+ * Only subtrees that can hold an answer are visited, so the cost is about
+ * the height of the tree per interval found (O(k log n), see above), not
+ * the number of intervals.
+ *
+ * Returns the number of intervals found (fn may be NULL to just count).
+ */
+int
+BTreeIntervalOverlap(node_td *root, int lo, int hi, intervalscan_fn fn, void *arg)
+{
+    return overlap(root, lo, hi, fn, arg);
+}
+
+/*
+ * call <fn> for every interval that contains <point>
+ *
+ * Returns the number of intervals found.
+ */
+int
+BTreeIntervalStab(node_td *root, int point, intervalscan_fn fn, void *arg)
+{
+    return overlap(root, point, point, fn, arg);
+}
@@ -0,0 +1,34 @@
+/*
+ * File:	btree_interval.h
+ *
+ * Include file for btree_interval.c, interval trees (stabbing and overlap queries).
+ *
+ */
+#ifndef __BTREE_INTERVAL_H__
+#define __BTREE_INTERVAL_H__
+
+/*
+ * the inline value of each interval tree node (see BTreeNewValueNode()),
+ * the interval is [node key, end]
+ */
+typedef struct btreeinterval_st
+{
+    int		end;		/* last point of this interval */
+    int		maxend;		/* biggest end in the subtree rooted here */
+    void	*data;		/* opaque data pointer, like node->data */
+} btreeinterval_td;
+
+/* the interval stored in node <p> */
+#define BTREE_INTERVAL(p)	((btreeinterval_td *) (p)->data)
+
+/* called for each interval a query finds */
+typedef void	(*intervalscan_fn)(int start, int end, void *data, void *arg);
+
+extern node_td	*BTreeIntervalInsert(node_td *root, int start, int end, void *data);
+extern int	BTreeIntervalDelete(node_td **root, int start);
+extern node_td	*BTreeIntervalRebalance(node_td *root);
+extern void	BTreeIntervalFix(node_td *root);
+extern int	BTreeIntervalStab(node_td *root, int point, intervalscan_fn fn, void *arg);
+extern int	BTreeIntervalOverlap(node_td *root, int lo, int hi, intervalscan_fn fn, void *arg);
+
+#endif /* __BTREE_INTERVAL_H__ */
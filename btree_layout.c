@@ -0,0 +1,137 @@
+/*
+ * File:	btree_layout.c
+ *
+ * Copy all the nodes of a tree into one fresh, contiguous block, in an
+ * order that keeps the nodes of a search path close together in memory.
+ *
+ * After a long run of inserts and deletes the nodes are scattered all
+ * over the heap and every level of a lookup is another cache miss.
+ * Re-packing them restores lookup speed without changing the tree: the
+ * shape, keys, indexes and data pointers all stay the same, only the
+ * nodes themselves move. Inline values (see btree.h) move with their
+ * nodes, so they stay right next to them.
+ *
+ * BTREE_LAYOUT_BFS puts the nodes level by level, so the top levels
+ * share a few cache lines. BTREE_LAYOUT_VEB (van Emde Boas) cuts the tree
+ * in half by height, lays out the top half, then each bottom subtree,
+ * recursively; any path then touches few blocks at every scale, no matter
+ * the cache line or page size.
+ *
+ * The old nodes are freed, so any node pointers kept outside the tree
+ * (BTreeCacheFindNode() caches, fingers) are stale afterwards. Not for
+ * persistent trees, their nodes are shared between versions.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "btree.h"
+#include "btree_layout.h"
+
+static void	vebLayout(node_td *p, int height, node_td **order, int *count);
+
+/*
+ * lay out the subtrees hanging <depth> levels below <p>, left to right
+ */
+static void
+vebBottoms(node_td *p, int depth, int height, node_td **order, int *count)
+{
+    if (p == (node_td *) NULL)
+	return;
+
+    if (depth == 0) {
+	vebLayout(p, height, order, count);
+	return;
+    }
+    vebBottoms(p->left, depth-1, height, order, count);
+    vebBottoms(p->right, depth-1, height, order, count);
+}
+
+/*
+ * van Emde Boas order of the top <height> levels of the subtree at <p>:
+ * top half of the levels first, then each of the bottom subtrees
+ */
+static void
+vebLayout(node_td *p, int height, node_td **order, int *count)
+{
+    int		top;
+
+    if (p == (node_td *) NULL || height <= 0)
+	return;
+
+    if (height == 1) {
+	order[(*count)++] = p;
+	return;
+    }
+
+    top = height/2;
+    vebLayout(p, top, order, count);
+    vebBottoms(p, top, height - top, order, count);
+}
+
+/*
+ * copy the tree at <root> into a new block of nodes in the given
+ * <order> (BTREE_LAYOUT_BFS or BTREE_LAYOUT_VEB), free the old nodes
+ *
+ * Returns the new root.
+ */
+node_td *
+BTreeRelayout(node_td *root, int order)
+{
+    node_td	**old, *nodes, *p, *q;
+    int		i, n, valsize, count = 0;
+
+    n = BTreeCountNodes(root);
+    if (n == 0)
+	return (node_td *) NULL;
+
+	/* list the old nodes in their new order (the root comes first either way) */
+    old = (node_td **) malloc(n * sizeof(node_td *));
+    if (order == BTREE_LAYOUT_VEB) {
+	vebLayout(root, BTreeGetHeight(root), old, &count);
+    } else {
+	old[count++] = root;
+	for (i=0; i<count; i++) {
+	    if (old[i]->left != (node_td *) NULL)
+		old[count++] = old[i]->left;
+	    if (old[i]->right != (node_td *) NULL)
+		old[count++] = old[i]->right;
+	}
+    }
+
+	/* copy them, and leave the new address in each old node's parent
+	 * pointer (we're done walking the old tree) so we can re-link
+	 */
+    valsize = BTreeNodeValueSize(root);
+    nodes = BTreeNewValueBlock(n, valsize);
+    for (i=0; i<n; i++) {
+	q = BTREE_BLOCK_NODE(nodes, i, valsize);
+	q->key = old[i]->key;
+	q->index = old[i]->index;
+	q->size = old[i]->size;
+	BTreeNodeSetValue(q, old[i]->data);
+	old[i]->parent = q;
+    }
+
+    for (i=0; i<n; i++) {
+	q = BTREE_BLOCK_NODE(nodes, i, valsize);
+	p = old[i]->left;
+	if (p != (node_td *) NULL) {
+	    q->left = p->parent;
+	    q->left->parent = q;
+	}
+	p = old[i]->right;
+	if (p != (node_td *) NULL) {
+	    q->right = p->parent;
+	    q->right->parent = q;
+	}
+    }
+
+    for (i=0; i<n; i++) {
+	BTreeFreeNode(old[i]);
+    }
+    free(old);
+
+    return nodes;
+}
+
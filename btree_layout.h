@@ -0,0 +1,16 @@
+/*
+ * File:	btree_layout.h
+ *
+ * Include file for btree_layout.c, re-packing a tree's nodes in memory.
+ *
+ */
+#ifndef __BTREE_LAYOUT_H__
+#define __BTREE_LAYOUT_H__
+
+#define BTREE_LAYOUT_BFS	0	/* level by level */
+#define BTREE_LAYOUT_VEB	1	/* van Emde Boas, recursive blocks of levels */
+
+extern node_td	*BTreeRelayout(node_td *root, int order);
+
+#endif /* __BTREE_LAYOUT_H__ */
+
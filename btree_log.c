@@ -0,0 +1,584 @@
+/*
+ * File:	btree_log.c
+ *
+ * Make a tree durable: a write-ahead log of inserts and deletes, plus
+ * checkpoints of the whole tree, so after a crash we can rebuild it from
+ * disk instead of from scratch.
+ *
+ *	root = BTreeLogRecover(path, datasize);		load checkpoint, replay log
+ *	log = BTreeLogOpen(path, datasize, groupsize);
+ *	BTreeLogInsertNode(log, &root, key, data);
+ *	BTreeLogDeleteNode(log, &root, key);
+ *	...
+ *	BTreeLogCheckpoint(log, root);			every so often
+ *
+ * Group commit: records are buffered and written out with one fsync
+ * once <groupsize> of them are pending (or on BTreeLogSync()). A change
+ * is durable once its group has been synced.
+ *
+ * If writing or syncing a group fails the log stops taking records:
+ * every later append, sync or checkpoint fails too, and nothing is
+ * written twice. (After a failed fsync there is no telling what reached
+ * the disk, so retrying can't be trusted.) Close it and open it again;
+ * that keeps every whole record that made it to disk. The change whose
+ * append failed may or may not be one of them.
+ *
+ * Keys are logged with <datasize> bytes copied from their data pointer
+ * (0 = keys only, data pointers come back NULL). With <datasize> > 0 the
+ * tree is a tree of inline values (see btree.h): recovery and
+ * BTreeLogInsertNode() store a copy of the data in each node, so there is
+ * nothing for the caller to free.
+ *
+ * A checkpoint is the tree's keys in sorted order, in <path>.ckpt, so
+ * recovery bulk-loads it with BTreeBuildSortedValues() in O(n), the
+ * checkpoint's keys and values go straight into one block of nodes. Each checkpoint
+ * starts a new log "epoch": the checkpoint remembers the epoch it covers
+ * and a log from that epoch or older is ignored, so a crash in the middle
+ * of a checkpoint never replays records twice. Records are checksummed,
+ * a torn record at the end of the log (crash during a write) ends replay.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "btree.h"
+#include "btree_log.h"
+
+#define LOG_MAGIC	0x42544c47	/* "BTLG" */
+#define CKPT_MAGIC	0x4254434b	/* "BTCK" */
+
+/* start of the log and checkpoint files */
+typedef struct fileheader_st
+{
+    int		magic;
+    int		datasize;
+    long	epoch;
+    long	count;		/* keys in a checkpoint (unused in the log) */
+} fileheader_td;
+
+/* each log record is this, followed by <datasize> bytes of data */
+typedef struct logrec_st
+{
+    int			op;
+    int			key;
+    unsigned int	sum;
+} logrec_td;
+
+#define LOG_RECSIZE(datasize)	((int) sizeof(logrec_td) + (datasize))
+
+/* FNV-1a over a record, to catch torn writes */
+static unsigned int
+checksum(int op, int key, const char *data, int datasize)
+{
+    unsigned int	h = 2166136261U;
+    int			i;
+
+    h = (h ^ (unsigned int) op) * 16777619U;
+    h = (h ^ (unsigned int) key) * 16777619U;
+    for (i=0; i<datasize; i++) {
+	h = (h ^ (unsigned char) data[i]) * 16777619U;
+    }
+    return h;
+}
+
+/* <path><suffix>, malloc'd */
+static char *
+makePath(const char *path, const char *suffix)
+{
+    char	*s;
+
+    s = (char *) malloc(strlen(path) + strlen(suffix) + 1);
+    strcpy(s, path);
+    strcat(s, suffix);
+    return s;
+}
+
+/* fsync the directory holding <path>, so a rename() is durable */
+static void
+syncDir(const char *path)
+{
+    char	*dir, *slash;
+    int		fd;
+
+    dir = makePath(path, "");
+    slash = strrchr(dir, '/');
+    if (slash == (char *) NULL) {
+	strcpy(dir, ".");
+    } else if (slash == dir) {
+	dir[1] = '\0';
+    } else {
+	*slash = '\0';
+    }
+
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+	fsync(fd);
+	close(fd);
+    }
+    free(dir);
+}
+
+static int
+writeAll(int fd, const char *buf, long len)
+{
+    long	n;
+
+    while (len > 0) {
+	n = write(fd, buf, len);
+	if (n < 0)
+	    return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
+
+/* write out the pending records with one fsync (caller holds the lock) */
+static int
+flushLog(btreelog_td *log)
+{
+    if (log->error)
+	return -1;
+    if (log->buflen == 0)
+	return 0;
+
+    if (writeAll(log->fd, log->buf, log->buflen) < 0 || fdatasync(log->fd) < 0) {
+	log->error = 1;
+	return -1;
+    }
+
+    log->buflen = 0;
+    log->pending = 0;
+    return 0;
+}
+
+/*
+ * start an empty log for <epoch>: write it beside the old one, then rename
+ * it into place so there is always a valid log file
+ */
+static int
+newLogFile(btreelog_td *log, long epoch)
+{
+    fileheader_td	hdr;
+    char		*tmp;
+    int			fd;
+
+    tmp = makePath(log->path, ".tmp");
+    fd = open(tmp, O_CREAT | O_TRUNC | O_WRONLY, 0644);
+    if (fd < 0) {
+	free(tmp);
+	return -1;
+    }
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = LOG_MAGIC;
+    hdr.datasize = log->datasize;
+    hdr.epoch = epoch;
+    if (writeAll(fd, (char *) &hdr, sizeof(hdr)) < 0 || fsync(fd) < 0 ||
+	rename(tmp, log->path) < 0) {
+	close(fd);
+	free(tmp);
+	return -1;
+    }
+    syncDir(log->path);
+    free(tmp);
+
+    if (log->fd >= 0)
+	close(log->fd);
+    log->fd = fd;
+    log->epoch = epoch;
+
+    return 0;
+}
+
+/*
+ * read the log at <path>, applying its records to <*root> (if root isn't NULL)
+ *
+ * Returns 1 if the log is usable (newer than the checkpoint epoch
+ * <ckptepoch>), with its epoch and the offset just past the last good
+ * record; 0 if there is no log or the checkpoint covers it; -1 if it
+ * isn't a log of <datasize> byte records.
+ */
+static int
+scanLog(const char *path, int datasize, long ckptepoch, node_td **root, long *epoch, long *validend)
+{
+    FILE		*fp;
+    fileheader_td	hdr;
+    logrec_td		rec;
+    char		*data;
+    node_td		*p;
+
+    fp = fopen(path, "rb");
+    if (fp == (FILE *) NULL)
+	return 0;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != LOG_MAGIC) {
+	fprintf(stderr,"%s : not a tree log\n", path);
+	fclose(fp);
+	return -1;
+    }
+    if (hdr.datasize != datasize) {
+	fprintf(stderr,"%s : log has %d bytes of data per key, not %d\n",
+		path, hdr.datasize, datasize);
+	fclose(fp);
+	return -1;
+    }
+    if (hdr.epoch <= ckptepoch) {
+	fclose(fp);
+	return 0;
+    }
+    *epoch = hdr.epoch;
+    *validend = sizeof(hdr);
+
+    data = (char *) malloc(datasize + 1);
+    while (fread(&rec, sizeof(rec), 1, fp) == 1 &&
+	   fread(data, 1, datasize, fp) == (size_t) datasize) {
+
+	if ((rec.op != BTREE_LOG_INSERT && rec.op != BTREE_LOG_DELETE) ||
+	    rec.sum != checksum(rec.op, rec.key, data, datasize))
+	    break;	/* torn write, the rest never made it to disk */
+
+	if (root != (node_td **) NULL) {
+	    p = BTreeFindNode(*root, rec.key);
+	    if (rec.op == BTREE_LOG_INSERT && p == (node_td *) NULL) {
+		*root = BTreeInsertValue(*root, rec.key, data, datasize);
+	    } else if (rec.op == BTREE_LOG_DELETE && p != (node_td *) NULL) {
+		BTreeDeleteNode(root, rec.key);
+	    }
+	}
+	*validend += LOG_RECSIZE(datasize);
+    }
+
+    free(data);
+    fclose(fp);
+    return 1;
+}
+
+/*
+ * load the checkpoint of <path> into <*root> (if root isn't NULL)
+ *
+ * Returns 1 with the epoch it covers in <*epoch>, 0 if there is none
+ * (<*epoch> is -1), or -1 if it isn't a checkpoint of <datasize> byte
+ * values.
+ */
+static int
+loadCheckpoint(const char *path, int datasize, node_td **root, long *epoch)
+{
+    FILE		*fp;
+    fileheader_td	hdr;
+    char		*ckpt, *values;
+    int			*keys;
+    void		**data;
+    long		i;
+
+    *epoch = -1;
+    ckpt = makePath(path, ".ckpt");
+    fp = fopen(ckpt, "rb");
+    free(ckpt);
+    if (fp == (FILE *) NULL)
+	return 0;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != CKPT_MAGIC) {
+	fprintf(stderr,"%s.ckpt : not a tree checkpoint\n", path);
+	fclose(fp);
+	return -1;
+    }
+    if (hdr.datasize != datasize) {
+	fprintf(stderr,"%s.ckpt : checkpoint has %d bytes of data per key, not %d\n",
+		path, hdr.datasize, datasize);
+	fclose(fp);
+	return -1;
+    }
+
+    if (root != (node_td **) NULL) {
+	keys = (int *) malloc((hdr.count + 1) * sizeof(int));
+	data = (void **) malloc((hdr.count + 1) * sizeof(void *));
+	values = (char *) malloc(hdr.count * datasize + 1);
+
+	for (i=0; i<hdr.count; i++) {
+	    if (fread(&keys[i], sizeof(int), 1, fp) != 1)
+		break;
+	    data[i] = NULL;
+	    if (datasize > 0) {
+		data[i] = values + i * datasize;
+		if (fread(data[i], datasize, 1, fp) != 1)
+		    break;
+	    }
+	}
+
+	*root = BTreeBuildSortedValues(keys, data, (int) i, datasize);
+	free(keys);
+	free(data);
+	free(values);
+    }
+
+    fclose(fp);
+    *epoch = hdr.epoch;
+    return 1;
+}
+
+/*
+ * rebuild a tree from the checkpoint and log at <path>
+ *
+ * Returns the root (NULL if there was nothing on disk, or the checkpoint
+ * is not one of <datasize> byte values).
+ */
+node_td *
+BTreeLogRecover(const char *path, int datasize)
+{
+    node_td	*root = (node_td *) NULL;
+    long	ckptepoch, epoch, end;
+
+    if (loadCheckpoint(path, datasize, &root, &ckptepoch) < 0)
+	return (node_td *) NULL;
+    scanLog(path, datasize, ckptepoch, &root, &epoch, &end);
+
+    return root;
+}
+
+/*
+ * open the log at <path> for appending (creating it if needed)
+ *
+ * Recover first: records already in the log are kept, a torn record at
+ * the end is cut off. A new, empty log is only started if there is none
+ * or the checkpoint covers it.
+ *
+ * Returns NULL if the log can't be opened, or the log or checkpoint
+ * there isn't one of <datasize> byte records.
+ */
+btreelog_td *
+BTreeLogOpen(const char *path, int datasize, int groupsize)
+{
+    btreelog_td		*log;
+    long		ckptepoch, epoch, end;
+    int			status;
+
+    if (groupsize < 1)
+	groupsize = 1;
+
+    log = (btreelog_td *) malloc(sizeof(btreelog_td));
+    pthread_mutex_init(&log->lock, NULL);
+    log->path = makePath(path, "");
+    log->fd = -1;
+    log->datasize = datasize;
+    log->groupsize = groupsize;
+    log->buf = (char *) malloc(groupsize * LOG_RECSIZE(datasize));
+    log->buflen = 0;
+    log->pending = 0;
+    log->error = 0;
+
+    status = loadCheckpoint(path, datasize, (node_td **) NULL, &ckptepoch);
+    if (status >= 0)
+	status = scanLog(path, datasize, ckptepoch, (node_td **) NULL, &epoch, &end);
+
+    if (status > 0) {
+	log->fd = open(path, O_WRONLY);
+	if (log->fd >= 0 && (ftruncate(log->fd, end) < 0 || lseek(log->fd, 0, SEEK_END) < 0)) {
+	    close(log->fd);
+	    log->fd = -1;
+	}
+	log->epoch = epoch;
+    } else if (status == 0) {
+	newLogFile(log, ckptepoch + 1);
+    }
+
+    if (log->fd < 0) {
+	BTreeLogClose(log);
+	return (btreelog_td *) NULL;
+    }
+
+    return log;
+}
+
+/*
+ * sync anything pending and close the log
+ */
+void
+BTreeLogClose(btreelog_td *log)
+{
+    if (log == (btreelog_td *) NULL)
+	return;
+
+    if (log->fd >= 0) {
+	flushLog(log);
+	close(log->fd);
+    }
+    pthread_mutex_destroy(&log->lock);
+    free(log->path);
+    free(log->buf);
+    free(log);
+}
+
+/*
+ * log one change (BTREE_LOG_INSERT or BTREE_LOG_DELETE)
+ *
+ * Returns 0, or -1 if the log has failed or writing the group out
+ * failed (see above: the change may or may not be in the log).
+ */
+int
+BTreeLogAppend(btreelog_td *log, int op, int key, void *data)
+{
+    logrec_td	rec;
+    char	*p;
+    int		status = 0;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (log->error || log->pending >= log->groupsize) {
+	pthread_mutex_unlock(&log->lock);	/* failed log, its buffer may be full */
+	return -1;
+    }
+
+    p = log->buf + log->buflen;
+    if (log->datasize > 0) {
+	if (data != NULL)
+	    memcpy(p + sizeof(rec), data, log->datasize);
+	else
+	    memset(p + sizeof(rec), 0, log->datasize);
+    }
+    rec.op = op;
+    rec.key = key;
+    rec.sum = checksum(op, key, p + sizeof(rec), log->datasize);
+    memcpy(p, &rec, sizeof(rec));
+
+    log->buflen += LOG_RECSIZE(log->datasize);
+    log->pending++;
+    if (log->pending >= log->groupsize)
+	status = flushLog(log);
+
+    pthread_mutex_unlock(&log->lock);
+
+    return status;
+}
+
+/*
+ * write out and fsync whatever is pending, everything logged so far is
+ * durable when this returns 0
+ */
+int
+BTreeLogSync(btreelog_td *log)
+{
+    int		status;
+
+    pthread_mutex_lock(&log->lock);
+    status = flushLog(log);
+    pthread_mutex_unlock(&log->lock);
+
+    return status;
+}
+
+/* in-order walk writing checkpoint records */
+static void
+writeCheckpoint(FILE *fp, node_td *p, int datasize, char *zeros, long *count)
+{
+    if (p == (node_td *) NULL)
+	return;
+
+    writeCheckpoint(fp, p->left, datasize, zeros, count);
+    fwrite(&p->key, sizeof(int), 1, fp);
+    if (datasize > 0)
+	fwrite((p->data != NULL) ? p->data : zeros, datasize, 1, fp);
+    (*count)++;
+    writeCheckpoint(fp, p->right, datasize, zeros, count);
+}
+
+/*
+ * write the whole tree to <path>.ckpt and start a new, empty log
+ *
+ * The tree must not change while we write it (call from the writer).
+ *
+ * Returns 0, or -1 on error (the old checkpoint and log are still good).
+ */
+int
+BTreeLogCheckpoint(btreelog_td *log, node_td *root)
+{
+    FILE		*fp;
+    fileheader_td	hdr;
+    char		*tmp, *ckpt, *zeros;
+    int			status = -1;
+
+    pthread_mutex_lock(&log->lock);
+
+    if (flushLog(log) < 0) {
+	pthread_mutex_unlock(&log->lock);
+	return -1;
+    }
+
+    tmp = makePath(log->path, ".ckpt.tmp");
+    ckpt = makePath(log->path, ".ckpt");
+    zeros = (char *) calloc(1, log->datasize + 1);
+
+    fp = fopen(tmp, "wb");
+    if (fp != (FILE *) NULL) {
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = CKPT_MAGIC;
+	hdr.datasize = log->datasize;
+	hdr.epoch = log->epoch;
+	fwrite(&hdr, sizeof(hdr), 1, fp);	/* count is filled in below */
+	writeCheckpoint(fp, root, log->datasize, zeros, &hdr.count);
+
+	if (fseek(fp, 0, SEEK_SET) == 0 && fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+	    fflush(fp) == 0 && fsync(fileno(fp)) == 0) {
+	    status = 0;
+	}
+	if (fclose(fp) != 0)
+	    status = -1;
+    }
+
+	/* checkpoint is safe on disk: swap it in, then start a fresh log.
+	 * (if the new log can't be made, the old one is now covered by the
+	 * checkpoint and further records would be ignored: the log fails
+	 * and has to be reopened)
+	 */
+    if (status == 0 && rename(tmp, ckpt) == 0) {
+	syncDir(ckpt);
+	status = newLogFile(log, log->epoch + 1);
+	if (status < 0)
+	    log->error = 1;
+    } else {
+	unlink(tmp);
+	status = -1;
+    }
+
+    free(tmp);
+    free(ckpt);
+    free(zeros);
+
+    pthread_mutex_unlock(&log->lock);
+    return status;
+}
+
+/*
+ * BTreeInsertValue() (BTreeInsertNode() for a keys only log), logged first
+ *
+ * Returns 0, or -1 if logging failed, and then the tree is left alone.
+ */
+int
+BTreeLogInsertNode(btreelog_td *log, node_td **root, int key, void *data)
+{
+    if (BTreeLogAppend(log, BTREE_LOG_INSERT, key, data) < 0)
+	return -1;
+
+    *root = BTreeInsertValue(*root, key, data, log->datasize);
+    return 0;
+}
+
+/*
+ * BTreeDeleteNode(), logged first
+ *
+ * Returns TRUE if the key was deleted, FALSE if it wasn't there, or -1
+ * if logging failed, and then the tree is left alone.
+ */
+int
+BTreeLogDeleteNode(btreelog_td *log, node_td **root, int key)
+{
+    if (BTreeLogAppend(log, BTREE_LOG_DELETE, key, NULL) < 0)
+	return -1;
+
+    return BTreeDeleteNode(root, key);
+}
+
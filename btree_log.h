@@ -0,0 +1,39 @@
+/*
+ * File:	btree_log.h
+ *
+ * Include file for btree_log.c, write-ahead log and checkpoints.
+ *
+ */
+#ifndef __BTREE_LOG_H__
+#define __BTREE_LOG_H__
+
+#include <pthread.h>
+
+#define BTREE_LOG_INSERT	1
+#define BTREE_LOG_DELETE	2
+
+typedef struct btreelog_st
+{
+    pthread_mutex_t	lock;		/* several threads may share a log */
+    char		*path;		/* the log; checkpoint is <path>.ckpt */
+    int			fd;
+    long		epoch;		/* bumped at every checkpoint */
+    int			datasize;	/* bytes of data logged per key (0 = keys only) */
+    int			groupsize;	/* fsync once this many records are pending */
+    char		*buf;		/* records not yet written */
+    int			buflen;
+    int			pending;	/* records in buf */
+    int			error;		/* a write or sync failed, the log takes no more */
+} btreelog_td;
+
+extern node_td		*BTreeLogRecover(const char *path, int datasize);
+extern btreelog_td	*BTreeLogOpen(const char *path, int datasize, int groupsize);
+extern void		BTreeLogClose(btreelog_td *log);
+extern int		BTreeLogAppend(btreelog_td *log, int op, int key, void *data);
+extern int		BTreeLogSync(btreelog_td *log);
+extern int		BTreeLogCheckpoint(btreelog_td *log, node_td *root);
+extern int		BTreeLogInsertNode(btreelog_td *log, node_td **root, int key, void *data);
+extern int		BTreeLogDeleteNode(btreelog_td *log, node_td **root, int key);
+
+#endif /* __BTREE_LOG_H__ */
+
@@ -0,0 +1,272 @@
+/*
+ * File:	btree_set.c
+ *
+ * Set operations (union, intersection, difference) on two trees.
+ *
+ * Instead of looking up every key of one tree in the other (O(n log m)),
+ * we flatten both trees into sorted arrays, merge the two arrays in one
+ * pass and build the result as a balanced tree, O(n + m) total.
+ *
+ * The result is a brand new tree, the input trees are not touched.
+ * All result nodes come from a single BTreeNewNodeBlock(). If the inputs
+ * hold inline values of the same size (see btree.h), so does the result,
+ * each node with its own copy; otherwise the result shares data pointers.
+ *
+ * For big inputs the work can be split across threads: each tree is
+ * flattened by its own thread, then the key range is cut into chunks
+ * and each chunk is merged by its own thread.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "btree.h"
+#include "btree_set.h"
+
+#define SET_UNION	0
+#define SET_INTERSECT	1
+#define SET_DIFFERENCE	2
+
+/* a tree flattened into sorted arrays */
+typedef struct setarray_st
+{
+    node_td	*root;
+    int		count;
+    int		*keys;
+    void	**data;
+} setarray_td;
+
+/* one chunk of merge work, [lo, hi) ranges of each input array */
+typedef struct setjob_st
+{
+    int		op;
+    setarray_td	*a, *b;
+    int		alo, ahi;
+    int		blo, bhi;
+    int		*okeys;		/* where this chunk writes its output */
+    void	**odata;
+    int		count;		/* number of keys written */
+} setjob_td;
+
+/*
+ * flatten one tree into a setarray (thread entry point too)
+ */
+static void *
+flattenThread(void *arg)
+{
+    setarray_td	*s = (setarray_td *) arg;
+
+    s->count = BTreeCountNodes(s->root);
+    s->keys = (int *) malloc((s->count + 1) * sizeof(int));
+    s->data = (void **) malloc((s->count + 1) * sizeof(void *));
+    BTreeFlatten(s->root, s->keys, s->data);
+
+    return NULL;
+}
+
+/*
+ * merge one chunk of the two sorted arrays (thread entry point too)
+ *
+ * For keys in both trees, the union keeps the data pointer from <a>.
+ */
+static void *
+mergeThread(void *arg)
+{
+    setjob_td	*job = (setjob_td *) arg;
+    int		*ak = job->a->keys, *bk = job->b->keys;
+    void	**ad = job->a->data, **bd = job->b->data;
+    int		i = job->alo, j = job->blo, n = 0;
+
+    while (i < job->ahi && j < job->bhi) {
+	if (ak[i] < bk[j]) {
+	    if (job->op != SET_INTERSECT) {
+		job->okeys[n] = ak[i];
+		job->odata[n++] = ad[i];
+	    }
+	    i++;
+	} else if (ak[i] > bk[j]) {
+	    if (job->op == SET_UNION) {
+		job->okeys[n] = bk[j];
+		job->odata[n++] = bd[j];
+	    }
+	    j++;
+	} else { /* key in both trees */
+	    if (job->op != SET_DIFFERENCE) {
+		job->okeys[n] = ak[i];
+		job->odata[n++] = ad[i];
+	    }
+	    i++;
+	    j++;
+	}
+    }
+
+	/* leftovers from whichever array is not used up */
+    if (job->op != SET_INTERSECT) {
+	for (; i < job->ahi; i++) {
+	    job->okeys[n] = ak[i];
+	    job->odata[n++] = ad[i];
+	}
+    }
+    if (job->op == SET_UNION) {
+	for (; j < job->bhi; j++) {
+	    job->okeys[n] = bk[j];
+	    job->odata[n++] = bd[j];
+	}
+    }
+
+    job->count = n;
+    return NULL;
+}
+
+/*
+ * first position in keys[0..count) that is >= key
+ */
+static int
+lowerBound(int *keys, int count, int key)
+{
+    int		lo = 0, hi = count, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo)/2;
+	if (keys[mid] < key)
+	    lo = mid + 1;
+	else
+	    hi = mid;
+    }
+    return lo;
+}
+
+/*
+ * do the set operation <op> on trees <a> and <b>, return the new tree
+ */
+static node_td *
+setOperation(node_td *a, node_td *b, int op, int nthreads)
+{
+    setarray_td	sa, sb, *big;
+    setjob_td	*jobs;
+    pthread_t	*tids, tid;
+    int		*okeys;
+    void	**odata;
+    int		i, total, osize, split, valsize;
+    node_td	*result;
+
+    sa.root = a;
+    sb.root = b;
+
+	/* small inputs aren't worth a thread (node sizes tell us without a walk) */
+    if (BTREE_SIZE(a) + BTREE_SIZE(b) < BTREE_SET_PARALLEL_MIN || nthreads < 1)
+	nthreads = 1;
+
+	/* flatten: each tree gets its own thread in parallel mode */
+    if (nthreads > 1 && pthread_create(&tid, NULL, flattenThread, &sb) == 0) {
+	flattenThread(&sa);
+	pthread_join(tid, NULL);
+    } else {
+	flattenThread(&sa);
+	flattenThread(&sb);
+    }
+
+	/* worst case output size, union could be everything */
+    osize = (op == SET_UNION) ? sa.count + sb.count : sa.count;
+    okeys = (int *) malloc((osize + 1) * sizeof(int));
+    odata = (void **) malloc((osize + 1) * sizeof(void *));
+
+	/* cut the key range into chunks, using evenly spaced keys
+	 * of the bigger tree as the split points
+	 */
+    jobs = (setjob_td *) malloc(nthreads * sizeof(setjob_td));
+    tids = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    big = (sa.count >= sb.count) ? &sa : &sb;
+
+    for (i=0; i<nthreads; i++) {
+	jobs[i].op = op;
+	jobs[i].a = &sa;
+	jobs[i].b = &sb;
+	if (i == 0) {
+	    jobs[i].alo = 0;
+	    jobs[i].blo = 0;
+	} else {
+	    split = big->keys[(int) (((long) i * big->count) / nthreads)];
+	    jobs[i].alo = lowerBound(sa.keys, sa.count, split);
+	    jobs[i].blo = lowerBound(sb.keys, sb.count, split);
+	    jobs[i-1].ahi = jobs[i].alo;
+	    jobs[i-1].bhi = jobs[i].blo;
+	}
+	    /* output can't overlap the next chunk's output */
+	split = (op == SET_UNION) ? jobs[i].alo + jobs[i].blo : jobs[i].alo;
+	jobs[i].okeys = okeys + split;
+	jobs[i].odata = odata + split;
+    }
+    jobs[nthreads-1].ahi = sa.count;
+    jobs[nthreads-1].bhi = sb.count;
+
+    for (i=1; i<nthreads; i++) {
+	if (pthread_create(&tids[i], NULL, mergeThread, &jobs[i]) != 0) {
+	    mergeThread(&jobs[i]);	/* no thread, do it ourselves */
+	    tids[i] = pthread_self();
+	}
+    }
+    mergeThread(&jobs[0]);
+    for (i=1; i<nthreads; i++) {
+	if (!pthread_equal(tids[i], pthread_self()))
+	    pthread_join(tids[i], NULL);
+    }
+
+	/* squeeze the chunk outputs together */
+    total = jobs[0].count;
+    for (i=1; i<nthreads; i++) {
+	if (jobs[i].okeys != okeys + total) {
+	    memmove(okeys + total, jobs[i].okeys, jobs[i].count * sizeof(int));
+	    memmove(odata + total, jobs[i].odata, jobs[i].count * sizeof(void *));
+	}
+	total += jobs[i].count;
+    }
+
+    valsize = BTreeNodeValueSize(a != (node_td *) NULL ? a : b);
+    if (a != (node_td *) NULL && b != (node_td *) NULL && BTreeNodeValueSize(b) != valsize)
+	valsize = 0;
+    result = BTreeBuildSortedValues(okeys, odata, total, valsize);
+
+    free(okeys);
+    free(odata);
+    free(jobs);
+    free(tids);
+    free(sa.keys);
+    free(sa.data);
+    free(sb.keys);
+    free(sb.data);
+
+    return result;
+}
+
+/*
+ * all keys in <a> or <b>
+ *
+ * (keys in both keep the data pointer from <a>)
+ */
+node_td *
+BTreeUnion(node_td *a, node_td *b, int nthreads)
+{
+    return setOperation(a, b, SET_UNION, nthreads);
+}
+
+/*
+ * keys in both <a> and <b> (data pointers from <a>)
+ */
+node_td *
+BTreeIntersection(node_td *a, node_td *b, int nthreads)
+{
+    return setOperation(a, b, SET_INTERSECT, nthreads);
+}
+
+/*
+ * keys in <a> that are not in <b>
+ */
+node_td *
+BTreeDifference(node_td *a, node_td *b, int nthreads)
+{
+    return setOperation(a, b, SET_DIFFERENCE, nthreads);
+}
+
@@ -0,0 +1,21 @@
+/*
+ * File:	btree_set.h
+ *
+ * Include file for btree_set.c, set operations on two trees.
+ *
+ */
+#ifndef __BTREE_SET_H__
+#define __BTREE_SET_H__
+
+/*
+ * below this many keys (both trees together) the set operations run
+ * single threaded, no matter how many threads are asked for
+ */
+#define BTREE_SET_PARALLEL_MIN	(64*1024)
+
+extern node_td	*BTreeUnion(node_td *a, node_td *b, int nthreads);
+extern node_td	*BTreeIntersection(node_td *a, node_td *b, int nthreads);
+extern node_td	*BTreeDifference(node_td *a, node_td *b, int nthreads);
+
+#endif /* __BTREE_SET_H__ */
+
@@ -0,0 +1,416 @@
+/*
+ * File:	btree_shard.c
+ *
+ * A tree split into shards by key range, so many threads can write at once.
+ *
+ * A single root means a single lock for all writers. Here the key space is
+ * cut into ranges, each range is its own ordinary tree with its own lock,
+ * and every insert/find/delete only locks the shard that owns its key.
+ * Writers to different shards never wait on each other.
+ *
+ * Since shards own disjoint, ordered key ranges, an ordered scan over all
+ * shards is just the in-order traversal of each shard, one after another.
+ *
+ * Routing a key takes no shared lock either. The map from key ranges to
+ * shards is read through one pointer and never changed: a split builds
+ * a new map and swaps the pointer (the RCU way), so readers only share
+ * read-only cache lines. A thread that routed with an old map may lock
+ * a shard that has since given the top of its range away; each shard
+ * knows where its range ends now (hikey), so the thread sees that under
+ * the shard lock and routes again. Old maps are kept until
+ * BTreeShardFree() (splits are rare, a map is small), so no reader ever
+ * looks at freed memory. Shards are cache line aligned so busy
+ * neighbours don't bounce a line between them.
+ *
+ * Traffic is rarely spread evenly, so each shard counts the operations
+ * routed to it and BTreeShardSplitHot() splits a shard that gets much more
+ * than its share in two at its median key.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "btree.h"
+#include "btree_shard.h"
+
+/* a shard has to see this many times the average traffic to get split */
+#define SHARD_HOT_FACTOR	2
+
+/* hikey of the last shard: past every key */
+#define SHARD_NO_HIKEY		((long) INT_MAX + 1)
+
+static shard_td *
+newShard(int lokey, long hikey, node_td *root)
+{
+    void	*mem;
+    shard_td	*s;
+
+    if (posix_memalign(&mem, BTREE_SHARD_LINE, sizeof(shard_td)) != 0)
+	return (shard_td *) NULL;
+
+    s = (shard_td *) mem;
+    pthread_mutex_init(&s->lock, NULL);
+    s->root = root;
+    s->lokey = lokey;
+    s->hikey = hikey;
+    s->ops = 0;
+
+    return s;
+}
+
+static shardmap_td *
+newMap(int nshards)
+{
+    shardmap_td	*map;
+
+    map = (shardmap_td *) malloc(sizeof(shardmap_td));
+    map->nshards = nshards;
+    map->shards = (shard_td **) malloc(nshards * sizeof(shard_td *));
+    map->retired = (shardmap_td *) NULL;
+
+    return map;
+}
+
+/* the current map */
+static shardmap_td *
+currentMap(shardtree_td *t)
+{
+    return __atomic_load_n(&t->map, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * find the shard that owns <key> in <map>: the last shard with lokey <= key
+ */
+static shard_td *
+findShard(shardmap_td *map, int key)
+{
+    int		lo = 0, hi = map->nshards - 1, mid;
+
+    while (lo < hi) {
+	mid = lo + (hi - lo + 1)/2;
+	if (map->shards[mid]->lokey <= key)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+    return map->shards[lo];
+}
+
+/*
+ * find and lock the shard that owns <key>
+ *
+ * A shard's lokey never changes and only a split (holding the shard lock)
+ * lowers its hikey, so once we hold the lock and the key is below hikey
+ * it's the right shard, whatever map we used to get there.
+ */
+static shard_td *
+lockShard(shardtree_td *t, int key)
+{
+    shard_td	*s;
+
+    for (;;) {
+	s = findShard(currentMap(t), key);
+	pthread_mutex_lock(&s->lock);
+	if ((long) key < s->hikey)
+	    return s;
+	pthread_mutex_unlock(&s->lock);		/* split under us, the new map has it */
+    }
+}
+
+/*
+ * create a sharded tree with <nshards> shards splitting [minkey, maxkey]
+ * into equal ranges. Keys outside the range still work, they go to the
+ * first or last shard. (Bounds the wrong way round are swapped, and there
+ * are never more shards than keys in the range.)
+ */
+shardtree_td *
+BTreeShardNew(int nshards, int minkey, int maxkey)
+{
+    shardtree_td	*t;
+    shardmap_td		*map;
+    long		span;
+    int			i, lokey;
+
+    if (minkey > maxkey) {
+	i = minkey;
+	minkey = maxkey;
+	maxkey = i;
+    }
+    span = (long) maxkey - (long) minkey + 1;
+    if (nshards > span)
+	nshards = (int) span;
+    if (nshards < 1)
+	nshards = 1;
+
+    t = (shardtree_td *) malloc(sizeof(shardtree_td));
+    pthread_mutex_init(&t->splitlock, NULL);
+    t->nshards = nshards;
+
+    map = newMap(nshards);
+    for (i=nshards-1; i>=0; i--) {
+	lokey = (i == 0) ? INT_MIN : (int) (minkey + (span * i) / nshards);
+	map->shards[i] = newShard(lokey, (i == nshards-1) ? SHARD_NO_HIKEY : map->shards[i+1]->lokey,
+				  (node_td *) NULL);
+    }
+    t->map = map;
+
+    return t;
+}
+
+/*
+ * free all the shards and their trees (no one may be using the tree)
+ */
+void
+BTreeShardFree(shardtree_td *t)
+{
+    shardmap_td	*map, *next;
+    int		i;
+
+    if (t == (shardtree_td *) NULL)
+	return;
+
+    map = t->map;
+    for (i=0; i<map->nshards; i++) {
+	BTreeFreeTree(map->shards[i]->root);
+	pthread_mutex_destroy(&map->shards[i]->lock);
+	free(map->shards[i]);
+    }
+    for (; map != (shardmap_td *) NULL; map = next) {
+	next = map->retired;
+	free(map->shards);
+	free(map);
+    }
+    pthread_mutex_destroy(&t->splitlock);
+    free(t);
+}
+
+/*
+ * insert a key, only the owning shard is locked
+ */
+void
+BTreeShardInsert(shardtree_td *t, int key, void *data)
+{
+    shard_td	*s;
+
+    s = lockShard(t, key);
+    s->root = BTreeInsertNode(s->root, key, s->root, 0, data);
+    s->ops++;
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*
+ * look up a key
+ *
+ * We can't hand back the node (another thread could delete it as soon as
+ * we unlock), so the data pointer is copied out instead.
+ *
+ * Returns TRUE if found.
+ */
+int
+BTreeShardFind(shardtree_td *t, int key, void **data)
+{
+    shard_td	*s;
+    node_td	*p;
+    int		found = 0;
+
+    s = lockShard(t, key);
+    p = BTreeFindNode(s->root, key);
+    if (p != (node_td *) NULL) {
+	if (data != (void **) NULL)
+	    *data = p->data;
+	found = 1;
+    }
+    s->ops++;
+    pthread_mutex_unlock(&s->lock);
+
+    return found;
+}
+
+/*
+ * delete a key, returns TRUE if it was there
+ */
+int
+BTreeShardDelete(shardtree_td *t, int key)
+{
+    shard_td	*s;
+    int		deleted;
+
+    s = lockShard(t, key);
+    deleted = BTreeDeleteNode(&s->root, key);
+    s->ops++;
+    pthread_mutex_unlock(&s->lock);
+
+    return deleted;
+}
+
+/* in-order walk of one shard's tree, limited to [lokey, hikey] */
+static void
+scanTree(node_td *p, int lokey, int hikey, shardscan_fn fn, void *arg)
+{
+    if (p == (node_td *) NULL)
+	return;
+
+    if (lokey < p->key)
+	scanTree(p->left, lokey, hikey, fn, arg);
+    if (lokey <= p->key && p->key <= hikey)
+	(*fn)(p->key, p->data, arg);
+    if (hikey > p->key)
+	scanTree(p->right, lokey, hikey, fn, arg);
+}
+
+/*
+ * call <fn> for every key in [lokey, hikey], in increasing key order
+ *
+ * Splits wait for the scan (so the map holds still), and each shard is
+ * locked while it is being scanned, so <fn> must not call back into the
+ * sharded tree.
+ */
+void
+BTreeShardScan(shardtree_td *t, int lokey, int hikey, shardscan_fn fn, void *arg)
+{
+    shardmap_td	*map;
+    shard_td	*s;
+    int		i;
+
+    pthread_mutex_lock(&t->splitlock);
+    map = t->map;
+
+    for (i=0; i<map->nshards; i++) {
+	s = map->shards[i];
+	if (s->hikey <= lokey)
+	    continue;		/* whole shard is below the range */
+	if (s->lokey > hikey)
+	    break;		/* this and the rest are above the range */
+
+	pthread_mutex_lock(&s->lock);
+	scanTree(s->root, lokey, hikey, fn, arg);
+	pthread_mutex_unlock(&s->lock);
+    }
+
+    pthread_mutex_unlock(&t->splitlock);
+}
+
+/*
+ * split shard number <shard> in two at its median key
+ *
+ * (caller holds the split lock, so the map is ours to replace)
+ *
+ * The shard stays locked while we work on it; the new upper shard is
+ * complete before the new map makes it visible, and the old shard's
+ * hikey drops before its lock does, so a thread that routed with the
+ * old map tries again. Both halves are rebuilt as balanced trees.
+ * Returns TRUE if the shard had enough keys to split.
+ */
+static int
+splitShard(shardtree_td *t, int shard)
+{
+    shardmap_td	*map, *nmap;
+    shard_td	*s, *ns;
+    node_td	*old;
+    int		*keys;
+    void	**data;
+    int		count, half, valsize, i;
+
+    map = t->map;
+    s = map->shards[shard];
+    pthread_mutex_lock(&s->lock);
+
+    count = BTreeCountNodes(s->root);
+    if (count < 2) {
+	pthread_mutex_unlock(&s->lock);
+	return 0;
+    }
+
+    keys = (int *) malloc(count * sizeof(int));
+    data = (void **) malloc(count * sizeof(void *));
+    BTreeFlatten(s->root, keys, data);
+    half = count/2;
+
+	/* inline values are copied out of the old nodes, so free them last */
+    valsize = BTreeNodeValueSize(s->root);
+    old = s->root;
+    ns = newShard(keys[half], s->hikey,
+		  BTreeBuildSortedValues(keys + half, data + half, count - half, valsize));
+    s->root = BTreeBuildSortedValues(keys, data, half, valsize);
+    BTreeFreeTree(old);
+
+    nmap = newMap(map->nshards + 1);
+    for (i=0; i<=shard; i++) {
+	nmap->shards[i] = map->shards[i];
+    }
+    nmap->shards[shard+1] = ns;
+    for (i=shard+1; i<map->nshards; i++) {
+	nmap->shards[i+1] = map->shards[i];
+    }
+    nmap->retired = map;
+    __atomic_store_n(&t->map, nmap, __ATOMIC_RELEASE);
+    t->nshards = nmap->nshards;
+
+    s->hikey = ns->lokey;
+    pthread_mutex_unlock(&s->lock);
+
+    free(keys);
+    free(data);
+
+    return 1;
+}
+
+/*
+ * split shard number <shard> in two at its median key
+ *
+ * Returns TRUE if it was split (shards with fewer than 2 keys can't be).
+ */
+int
+BTreeShardSplit(shardtree_td *t, int shard)
+{
+    int		split = 0;
+
+    pthread_mutex_lock(&t->splitlock);
+    if (shard >= 0 && shard < t->map->nshards)
+	split = splitShard(t, shard);
+    pthread_mutex_unlock(&t->splitlock);
+
+    return split;
+}
+
+/*
+ * split the busiest shard, if it got more than SHARD_HOT_FACTOR times the
+ * average number of operations since the last call. Call this every so
+ * often from a housekeeping thread.
+ *
+ * Returns TRUE if a shard was split.
+ */
+int
+BTreeShardSplitHot(shardtree_td *t)
+{
+    shardmap_td	*map;
+    shard_td	*s;
+    long	total = 0, ops, hotops = 0;
+    int		i, hot = 0, split = 0;
+
+    pthread_mutex_lock(&t->splitlock);
+    map = t->map;
+
+    for (i=0; i<map->nshards; i++) {
+	s = map->shards[i];
+	pthread_mutex_lock(&s->lock);
+	ops = s->ops;
+	s->ops = 0;
+	pthread_mutex_unlock(&s->lock);
+
+	total += ops;
+	if (ops > hotops) {
+	    hotops = ops;
+	    hot = i;
+	}
+    }
+
+    if (total > 0 && hotops * map->nshards > SHARD_HOT_FACTOR * total)
+	split = splitShard(t, hot);
+
+    pthread_mutex_unlock(&t->splitlock);
+
+    return split;
+}
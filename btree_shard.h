@@ -0,0 +1,62 @@
+/*
+ * File:	btree_shard.h
+ *
+ * Include file for btree_shard.c, a tree split by key range into
+ * independently locked shards.
+ *
+ */
+#ifndef __BTREE_SHARD_H__
+#define __BTREE_SHARD_H__
+
+#include <pthread.h>
+
+#define BTREE_SHARD_LINE	64	/* cache line size, shards don't share lines */
+
+/*
+ * one shard: an ordinary tree holding the keys in [lokey, hikey)
+ */
+typedef struct shard_st
+{
+    pthread_mutex_t	lock;		/* protects root, hikey and ops */
+    node_td		*root;
+    int			lokey;		/* smallest key routed to this shard (never changes) */
+    long		hikey;		/* keys from here on belong to later shards (shrinks on a split) */
+    long		ops;		/* insert/find/delete calls since the last BTreeShardSplitHot() */
+} __attribute__ ((aligned (BTREE_SHARD_LINE))) shard_td;
+
+/*
+ * which shard owns which keys: shards sorted by lokey, shard 0 takes
+ * everything below shard 1. A map is never changed once published, a
+ * split publishes a new one.
+ */
+typedef struct shardmap_st
+{
+    int			nshards;
+    shard_td		**shards;
+    struct shardmap_st	*retired;	/* the maps this one replaced */
+} shardmap_td;
+
+/*
+ * the sharded tree
+ */
+typedef struct shardtree_st
+{
+    shardmap_td		*map;		/* current map, read without locking */
+    pthread_mutex_t	splitlock;	/* serializes splits, scans and BTreeShardSplitHot() */
+    int			nshards;	/* shards in the current map */
+} shardtree_td;
+
+/* callback for BTreeShardScan(), called in increasing key order */
+typedef void	(*shardscan_fn)(int key, void *data, void *arg);
+
+extern shardtree_td	*BTreeShardNew(int nshards, int minkey, int maxkey);
+extern void		BTreeShardFree(shardtree_td *t);
+extern void		BTreeShardInsert(shardtree_td *t, int key, void *data);
+extern int		BTreeShardFind(shardtree_td *t, int key, void **data);
+extern int		BTreeShardDelete(shardtree_td *t, int key);
+extern void		BTreeShardScan(shardtree_td *t, int lokey, int hikey, shardscan_fn fn, void *arg);
+extern int		BTreeShardSplit(shardtree_td *t, int shard);
+extern int		BTreeShardSplitHot(shardtree_td *t);
+
+#endif /* __BTREE_SHARD_H__ */
+
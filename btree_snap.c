@@ -0,0 +1,308 @@
+/*
+ * File:	btree_snap.c
+ *
+ * Persistent (copy-on-write) versions of insert and delete, so readers can
+ * hold a stable snapshot of a tree while a writer keeps changing it.
+ *
+ * A version of the tree is just a root pointer that holds one reference
+ * (node->refcnt) on the root node. Every node holds one reference on each
+ * of its children. Versions share all the nodes they have in common.
+ *
+ * The writer's tree is a version like any other:
+ *
+ *	root = BTreeSnapInsert(root, key, data);
+ *	root = BTreeSnapDelete(root, key);
+ *
+ * (or BTreeSnapInsertValue() for a tree of inline values, see btree.h)
+ * each take over the caller's reference to the old root and hand back the
+ * new one. Nodes no other version can see are changed in place, shared
+ * nodes (and everything below a shared node) are copied along the search
+ * path only (path copying), so a write costs at most O(height) new nodes
+ * while snapshots exist and none otherwise. A write walks down once and
+ * copies on the way back up, when it knows the key is there (or isn't),
+ * so a duplicate insert or a delete of a missing key copies nothing.
+ *
+ * Taking a snapshot is O(1), it just adds a reference to the root:
+ *
+ *	snap = BTreeSnapshot(root);
+ *	... BTreeFindNode(snap, key), traversals, etc. ...
+ *	BTreeSnapRelease(snap);
+ *
+ * Snapshots must be taken by the writer (or under the writer's lock);
+ * they can be read and released from any thread.
+ *
+ * Since nodes are shared between versions, they can't have a single parent:
+ * the parent pointer is always NULL in persistent trees. The index is kept
+ * by inserts, but not for subtrees that a delete moves up a level (shared
+ * nodes can't be renumbered). Don't use BTreeInsertNode(), BTreeDeleteNode(),
+ * BTreeRebalance() or BTreeFreeTree() on a persistent tree. Node copies carry
+ * their own copy of an inline value, so don't BTreeNodeSetValue() a node a
+ * snapshot may share either.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "btree.h"
+#include "btree_snap.h"
+#include "btree_trace.h"
+
+/* add a reference to a node */
+static void
+holdNode(node_td *p)
+{
+    if (p != (node_td *) NULL)
+	__sync_add_and_fetch(&p->refcnt, 1);
+}
+
+/* can another version see node <p>? (only the writer adds references) */
+#define SHARED(p)	((p) != (node_td *) NULL && __atomic_load_n(&(p)->refcnt, __ATOMIC_ACQUIRE) > 1)
+
+/*
+ * a write below <p> turned its child on one side (left if <left>) into
+ * <c>: point <p> at <c>
+ *
+ * If <shared> another version can see <p>, so the change goes into a copy
+ * (which references the other child too) and <p> stays as it was.
+ * Otherwise <p> is changed in place; if the old child was <oldshared> the
+ * write below left it alone for the other versions, and our reference to
+ * it goes. (An unshared old child was changed in place or freed already.)
+ *
+ * Returns the node to put in p's place.
+ */
+static node_td *
+setChild(node_td *p, int left, node_td *c, int shared, int oldshared)
+{
+    node_td	*q;
+
+    if (shared) {
+	q = BTreeCopyNode(p);
+	q->left = p->left;
+	q->right = p->right;
+	holdNode(left ? q->right : q->left);
+    } else {
+	q = p;
+	if (oldshared)
+	    BTreeSnapRelease(left ? p->left : p->right);
+    }
+
+    if (left)
+	q->left = c;
+    else
+	q->right = c;
+    return q;
+}
+
+/*
+ * recursive insert into subtree <p>, <shared> if another version can see it
+ *
+ * Nothing is changed on the way down, only on the way back up once the key
+ * turned out to be new (*added is set). Returns the new subtree.
+ */
+static node_td *
+snapInsert(node_td *p, int key, void *data, int valsize, int index, int shared, int *added)
+{
+    node_td	*c;
+    int		cshared;
+
+    if (p == (node_td *) NULL) {
+	*added = 1;
+	return BTreeNewValueNode(key, (node_td *) NULL, index, data, valsize);
+    }
+
+    if (key < p->key) {
+	cshared = shared || SHARED(p->left);
+	c = snapInsert(p->left, key, data, valsize, (2*p->index)+1, cshared, added);
+	if (!*added)
+	    return p;
+	p = setChild(p, 1, c, shared, cshared);
+    } else if (key > p->key) {
+	cshared = shared || SHARED(p->right);
+	c = snapInsert(p->right, key, data, valsize, (2*p->index)+2, cshared, added);
+	if (!*added)
+	    return p;
+	p = setChild(p, 0, c, shared, cshared);
+    } else {
+	return p;		/* duplicate, nothing changes */
+    }
+
+    p->size++;
+    return p;
+}
+
+/*
+ * unhook the smallest node of subtree <p> (<shared> as in snapInsert()),
+ * moving its key and data (or inline value) into node <to>.
+ * Returns the new subtree.
+ */
+static node_td *
+snapRemoveMin(node_td *p, node_td *to, int shared)
+{
+    node_td	*c, *right;
+    int		cshared;
+
+    if (p->left == (node_td *) NULL) {
+	to->key = p->key;
+	BTreeNodeSetValue(to, p->data);
+	right = p->right;
+	if (shared)
+	    holdNode(right);	/* p keeps its own reference for the others */
+	else
+	    BTreeFreeNode(p);	/* our reference on right moves up to our parent */
+	return right;
+    }
+
+    cshared = shared || SHARED(p->left);
+    c = snapRemoveMin(p->left, to, cshared);
+    p = setChild(p, 1, c, shared, cshared);
+    p->size--;
+    return p;
+}
+
+/*
+ * recursive delete from subtree <p> (<shared> as in snapInsert()), sets
+ * *found if the key was there. Returns the new subtree.
+ */
+static node_td *
+snapDelete(node_td *p, int key, int shared, int *found)
+{
+    node_td	*c, *q, *old;
+    int		cshared;
+
+    if (p == (node_td *) NULL)
+	return p;		/* not there, nothing changes */
+
+    if (key < p->key) {
+	cshared = shared || SHARED(p->left);
+	c = snapDelete(p->left, key, cshared, found);
+	if (!*found)
+	    return p;
+	p = setChild(p, 1, c, shared, cshared);
+	p->size--;
+	return p;
+    }
+    if (key > p->key) {
+	cshared = shared || SHARED(p->right);
+	c = snapDelete(p->right, key, cshared, found);
+	if (!*found)
+	    return p;
+	p = setChild(p, 0, c, shared, cshared);
+	p->size--;
+	return p;
+    }
+
+	/* found it. With one child (or none) the child takes our place */
+    *found = 1;
+    if (p->left == (node_td *) NULL || p->right == (node_td *) NULL) {
+	c = (p->left != (node_td *) NULL) ? p->left : p->right;
+	if (shared)
+	    holdNode(c);
+	else
+	    BTreeFreeNode(p);
+	return c;
+    }
+
+	/* two children: replace with the smallest key of the right subtree */
+    old = p->right;
+    cshared = shared || SHARED(old);
+    if (shared) {
+	q = BTreeCopyNode(p);
+	q->left = p->left;
+	holdNode(q->left);
+    } else {
+	q = p;
+    }
+    q->right = snapRemoveMin(old, q, cshared);
+    if (!shared && cshared)
+	BTreeSnapRelease(old);
+    q->size--;
+    return q;
+}
+
+/*
+ * insert a key into a persistent tree
+ *
+ * Takes over the caller's reference to <root>, returns the new version.
+ * Duplicate keys are ignored (and nothing gets copied).
+ */
+node_td *
+BTreeSnapInsert(node_td *root, int key, void *data)
+{
+    return BTreeSnapInsertValue(root, key, data, 0);
+}
+
+/*
+ * insert a key into a persistent tree of inline values, with a copy of the
+ * <valsize> bytes at <value> (see BTreeNewValueNode())
+ *
+ * Same rules as BTreeSnapInsert().
+ */
+node_td *
+BTreeSnapInsertValue(node_td *root, int key, const void *value, int valsize)
+{
+    node_td	*p;
+    int		shared, added = 0;
+    BTREE_TRACE_ENTER(tree, root);
+
+    shared = SHARED(root);
+    p = snapInsert(root, key, (void *) value, valsize, 0, shared, &added);
+    if (added && shared)
+	BTreeSnapRelease(root);		/* our reference moves to the new version */
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_INSERT, tree, p, key, 0);
+    return p;
+}
+
+/*
+ * delete a key from a persistent tree
+ *
+ * Takes over the caller's reference to <root>, returns the new version
+ * (which may be NULL if the tree is now empty).
+ */
+node_td *
+BTreeSnapDelete(node_td *root, int key)
+{
+    node_td	*p;
+    int		shared, found = 0;
+    BTREE_TRACE_ENTER(tree, root);
+
+    shared = SHARED(root);
+    p = snapDelete(root, key, shared, &found);
+    if (found && shared)
+	BTreeSnapRelease(root);
+
+    BTREE_TRACE_LEAVE(BTREE_TRACE_DELETE, tree, p, key, found);
+    return p;
+}
+
+/*
+ * take a snapshot of a persistent tree
+ *
+ * O(1): the snapshot is the same root with one more reference on it.
+ * Release it with BTreeSnapRelease() when done.
+ */
+node_td *
+BTreeSnapshot(node_td *root)
+{
+    holdNode(root);
+    return root;
+}
+
+/*
+ * drop a reference to a version (or snapshot) of a persistent tree
+ *
+ * Nodes that are no longer referenced by any version get freed.
+ */
+void
+BTreeSnapRelease(node_td *root)
+{
+    if (root == (node_td *) NULL)
+	return;
+
+    if (__sync_sub_and_fetch(&root->refcnt, 1) == 0) {
+	BTreeSnapRelease(root->left);
+	BTreeSnapRelease(root->right);
+	BTreeFreeNode(root);
+    }
+}
+
@@ -0,0 +1,17 @@
+/*
+ * File:	btree_snap.h
+ *
+ * Include file for btree_snap.c, persistent (copy-on-write) trees and snapshots.
+ *
+ */
+#ifndef __BTREE_SNAP_H__
+#define __BTREE_SNAP_H__
+
+extern node_td	*BTreeSnapInsert(node_td *root, int key, void *data);
+extern node_td	*BTreeSnapInsertValue(node_td *root, int key, const void *value, int valsize);
+extern node_td	*BTreeSnapDelete(node_td *root, int key);
+extern node_td	*BTreeSnapshot(node_td *root);
+extern void	BTreeSnapRelease(node_td *root);
+
+#endif /* __BTREE_SNAP_H__ */
+
@@ -0,0 +1,189 @@
+/*
+ * File:	btree_stats.c
+ *
+ * Hot path instrumentation: how many comparisons and levels our searches
+ * take, how many nodes get allocated, freed and re-inserted, and how long
+ * each find/insert/delete/rebalance call takes (as log2 histograms).
+ *
+ * Counting is only compiled in with -DBTREE_STATS (see btree_stats.h).
+ * Every thread counts into its own block (no atomics on the hot path),
+ * BTreeStatsGet() adds them all up.
+ *
+ * Watch BTreeStatsMaxDepth(): a tree that is turning into a linked list
+ * shows up there long before lookups get really slow.
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "btree_stats.h"
+
+static btreestats_td	*allStats = (btreestats_td *) NULL;
+static pthread_mutex_t	statsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char	*opNames[BTREE_OP_COUNT] = { "find", "insert", "delete", "rebalance" };
+
+#ifdef BTREE_STATS
+
+__thread btreestats_td	*BTreeStatsThread = (btreestats_td *) NULL;
+
+/*
+ * first time a thread counts something, give it a block and hook it on the list
+ *
+ * (blocks are never freed, a thread's counts stay in the totals after it exits)
+ */
+btreestats_td *
+BTreeStatsNewThread(void)
+{
+    btreestats_td	*s;
+
+    s = (btreestats_td *) calloc(1, sizeof(btreestats_td));
+
+    pthread_mutex_lock(&statsLock);
+    s->next = allStats;
+    allStats = s;
+    pthread_mutex_unlock(&statsLock);
+
+    BTreeStatsThread = s;
+    return s;
+}
+
+/* monotonic clock in nanoseconds */
+unsigned long
+BTreeStatsClock(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + (unsigned long) ts.tv_nsec;
+}
+
+/* count one call of <op> that started at <start> */
+void
+BTreeStatsLatency(int op, unsigned long start)
+{
+    btreestats_td	*s = BTREE_STATS_LOCAL();
+    unsigned long	ns = BTreeStatsClock() - start;
+    int			bucket = 0;
+
+    while (ns > 1 && bucket < BTREE_STATS_LATENCY_BUCKETS-1) {
+	ns >>= 1;
+	bucket++;
+    }
+
+    s->ops[op]++;
+    s->latency[op][bucket]++;
+}
+
+#endif /* BTREE_STATS */
+
+/*
+ * add up the counters of all threads into <total>
+ *
+ * (counters of running threads may be a little behind, we don't stop them)
+ */
+void
+BTreeStatsGet(btreestats_td *total)
+{
+    btreestats_td	*s;
+    int			i, j;
+
+    memset(total, 0, sizeof(btreestats_td));
+
+    pthread_mutex_lock(&statsLock);
+    for (s = allStats; s != (btreestats_td *) NULL; s = s->next) {
+	total->lookups += s->lookups;
+	total->compares += s->compares;
+	total->allocated += s->allocated;
+	total->freed += s->freed;
+	total->reinserted += s->reinserted;
+	total->cachehits += s->cachehits;
+	total->cachemisses += s->cachemisses;
+	total->filtered += s->filtered;
+	total->filterfalse += s->filterfalse;
+	for (i=0; i<BTREE_STATS_DEPTH_BUCKETS; i++) {
+	    total->depth[i] += s->depth[i];
+	}
+	for (i=0; i<BTREE_OP_COUNT; i++) {
+	    total->ops[i] += s->ops[i];
+	    for (j=0; j<BTREE_STATS_LATENCY_BUCKETS; j++) {
+		total->latency[i][j] += s->latency[i][j];
+	    }
+	}
+    }
+    pthread_mutex_unlock(&statsLock);
+
+    total->next = (btreestats_td *) NULL;
+}
+
+/*
+ * zero all the counters
+ */
+void
+BTreeStatsReset(void)
+{
+    btreestats_td	*s, *next;
+
+    pthread_mutex_lock(&statsLock);
+    for (s = allStats; s != (btreestats_td *) NULL; s = next) {
+	next = s->next;
+	memset(s, 0, sizeof(btreestats_td));
+	s->next = next;
+    }
+    pthread_mutex_unlock(&statsLock);
+}
+
+/*
+ * deepest search seen (number of levels visited), 0 if there were none
+ */
+int
+BTreeStatsMaxDepth(btreestats_td *stats)
+{
+    int		i;
+
+    for (i=BTREE_STATS_DEPTH_BUCKETS-1; i>0; i--) {
+	if (stats->depth[i] != 0)
+	    return i;
+    }
+    return 0;
+}
+
+/*
+ * print out the counters as text
+ */
+void
+BTreeStatsPrint(FILE *fp, btreestats_td *stats)
+{
+    int		i, j;
+
+    fprintf(fp,"lookups %lu, compares %lu", stats->lookups, stats->compares);
+    if (stats->lookups != 0)
+	fprintf(fp," (%.2f per lookup)", (double) stats->compares / (double) stats->lookups);
+    fprintf(fp,", max depth %d\n", BTreeStatsMaxDepth(stats));
+
+    fprintf(fp,"nodes allocated %lu, freed %lu, re-inserted by delete %lu\n",
+	stats->allocated, stats->freed, stats->reinserted);
+
+    fprintf(fp,"front cache hits %lu, misses %lu\n", stats->cachehits, stats->cachemisses);
+    fprintf(fp,"filter turned away %lu, false positives %lu\n", stats->filtered, stats->filterfalse);
+
+    fprintf(fp,"lookup depth:");
+    for (i=0; i<BTREE_STATS_DEPTH_BUCKETS; i++) {
+	if (stats->depth[i] != 0)
+	    fprintf(fp," %d%s:%lu", i, (i == BTREE_STATS_DEPTH_BUCKETS-1) ? "+" : "", stats->depth[i]);
+    }
+    fprintf(fp,"\n");
+
+    for (i=0; i<BTREE_OP_COUNT; i++) {
+	fprintf(fp,"%s calls %lu, latency (ns):", opNames[i], stats->ops[i]);
+	for (j=0; j<BTREE_STATS_LATENCY_BUCKETS; j++) {
+	    if (stats->latency[i][j] != 0)
+		fprintf(fp," <%lu:%lu", 2UL << j, stats->latency[i][j]);
+	}
+	fprintf(fp,"\n");
+    }
+}
+
@@ -0,0 +1,80 @@
+/*
+ * File:	btree_stats.h
+ *
+ * Include file for btree_stats.c, hot path counters and latency histograms.
+ *
+ * Compile with -DBTREE_STATS to turn the counting on. Without it the
+ * BTREE_STATS_* macros compile to nothing, so there is no cost at all,
+ * and BTreeStatsGet() just returns zeros.
+ *
+ */
+#ifndef __BTREE_STATS_H__
+#define __BTREE_STATS_H__
+
+#include <stdio.h>
+
+#define BTREE_STATS_DEPTH_BUCKETS	64	/* lookup depth 0..62, last bucket is "deeper" */
+#define BTREE_STATS_LATENCY_BUCKETS	32	/* bucket i counts calls taking [2^i, 2^(i+1)) ns */
+
+/* the operations we time */
+#define BTREE_OP_FIND		0
+#define BTREE_OP_INSERT		1
+#define BTREE_OP_DELETE		2
+#define BTREE_OP_REBALANCE	3
+#define BTREE_OP_COUNT		4
+
+typedef struct btreestats_st
+{
+    unsigned long	lookups;	/* searches of the tree (including the one inside delete) */
+    unsigned long	compares;	/* key comparisons made by those searches */
+    unsigned long	depth[BTREE_STATS_DEPTH_BUCKETS];	/* levels visited per search */
+    unsigned long	allocated;	/* nodes from BTreeNewNode() and BTreeNewNodeBlock() */
+    unsigned long	freed;		/* nodes given to BTreeFreeNode() */
+    unsigned long	reinserted;	/* nodes BTreeDeleteNode() had to re-insert */
+    unsigned long	cachehits;	/* BTreeCacheFindNode() answered from the cache */
+    unsigned long	cachemisses;	/* ... and had to search the tree */
+    unsigned long	filtered;	/* BTreeFilterFindNode() misses the filter answered */
+    unsigned long	filterfalse;	/* ... the filter said maybe, the tree said no */
+    unsigned long	ops[BTREE_OP_COUNT];
+    unsigned long	latency[BTREE_OP_COUNT][BTREE_STATS_LATENCY_BUCKETS];
+    struct btreestats_st	*next;	/* list of every thread's counters */
+} btreestats_td;
+
+extern void		BTreeStatsGet(btreestats_td *total);
+extern void		BTreeStatsReset(void);
+extern int		BTreeStatsMaxDepth(btreestats_td *stats);
+extern void		BTreeStatsPrint(FILE *fp, btreestats_td *stats);
+
+#ifdef BTREE_STATS
+
+/* each thread counts into its own btreestats_td, so counting never contends */
+extern __thread btreestats_td	*BTreeStatsThread;
+extern btreestats_td	*BTreeStatsNewThread(void);
+extern unsigned long	BTreeStatsClock(void);
+extern void		BTreeStatsLatency(int op, unsigned long start);
+
+#define BTREE_STATS_LOCAL()	(BTreeStatsThread != (btreestats_td *) NULL ? \
+				 BTreeStatsThread : BTreeStatsNewThread())
+#define BTREE_STATS_ADD(field, n)	(BTREE_STATS_LOCAL()->field += (n))
+#define BTREE_STATS_LOOKUP(levels, cmps)					\
+	do {									\
+	    btreestats_td *s_ = BTREE_STATS_LOCAL();				\
+	    s_->lookups++;							\
+	    s_->compares += (cmps);						\
+	    s_->depth[(levels) < BTREE_STATS_DEPTH_BUCKETS ?			\
+		      (levels) : BTREE_STATS_DEPTH_BUCKETS-1]++;		\
+	} while (0)
+#define BTREE_STATS_TIMER(start)	unsigned long start = BTreeStatsClock()
+#define BTREE_STATS_LATENCY(op, start)	BTreeStatsLatency((op), (start))
+
+#else
+
+#define BTREE_STATS_ADD(field, n)
+#define BTREE_STATS_LOOKUP(levels, cmps)
+#define BTREE_STATS_TIMER(start)
+#define BTREE_STATS_LATENCY(op, start)
+
+#endif /* BTREE_STATS */
+
+#endif /* __BTREE_STATS_H__ */
+
@@ -0,0 +1,527 @@
+/*
+ * File:	btree_trace.c
+ *
+ * Record the tree calls a running program makes into a compact binary
+ * trace, and replay a trace at full speed with timing, so the real
+ * access pattern of a program can be benchmarked offline against
+ * changes to the tree code.
+ *
+ * Recording (build with -DBTREE_TRACE):
+ *
+ *	BTreeTraceStart("run.trace");
+ *	... the program runs as usual ...
+ *	BTreeTraceStop();
+ *
+ * Every BTreeFindNode(), BTreeInsertNode()/BTreeInsertValue(),
+ * BTreeDeleteNode(), BTreeRebalance*() and BTreeFreeTree() call is
+ * written as a 12 byte record: the key, the tree, the op, a small id of
+ * the calling thread and whether a find or delete hit. So are the calls
+ * of the other modules that do one of those to a tree (BTreeCacheFindNode()
+ * and BTreeFilterFindNode() are finds, hits or not, BTreeSnapInsert() and
+ * BTreeIntervalInsert() are inserts, and so on). Only the outermost call
+ * is recorded: the tree calls a module makes to do its job are not.
+ *
+ * Trees are numbered as they show up. A call that hands back a different
+ * root (an insert into an empty tree, a rebalance, ...) keeps its number
+ * for the new root, so a tree is followed from root to root as long as
+ * every call that changes its root is recorded. Calls that aren't
+ * (batches, set operations, BTreeBuildSorted(), finger inserts, buffered
+ * ingest, relayouts, shard splits) change trees behind the trace's back:
+ * a tree they build shows up as a new, empty one, and replays of the
+ * trees they touch can come out differently. Old versions and snapshots
+ * of persistent trees (btree_snap.c) look like new trees as well.
+ *
+ * Each thread fills its own buffer and appends it to the file when full.
+ * Recording a call takes a global lock to look the tree up (a small hash
+ * table of roots), so it costs that lock plus a store per call and a
+ * write every TRACE_BUFSIZE calls.
+ *
+ * Stop the trace while no tree calls are in flight: BTreeTraceStop()
+ * writes out every thread's buffer.
+ *
+ * Replay (BTreeTraceReplay()) starts each tree out empty. With several
+ * threads, each replays the records of the recorded threads assigned to
+ * it (thread id modulo nthreads), in order, on the shared trees behind a
+ * read/write lock (finds share it, everything else is exclusive).
+ *
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "btree.h"
+#include "btree_trace.h"
+
+#define TRACE_BUFSIZE	4096		/* records buffered per thread */
+#define TRACE_TREES	1024		/* hash buckets for the roots of the trees */
+
+/* start of a trace file, the records follow */
+typedef struct traceheader_st
+{
+    int		magic;
+    int		recsize;	/* sizeof(btreetracerec_td) when written */
+} traceheader_td;
+
+static const char	*opNames[BTREE_TRACE_OPS] = {
+    "find", "insert", "delete", "rebalance", "rebalance subtree", "rebalance step", "free"
+};
+
+/* monotonic clock in nanoseconds */
+static unsigned long
+traceClock(void)
+{
+    struct timespec	ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long) ts.tv_sec * 1000000000UL + (unsigned long) ts.tv_nsec;
+}
+
+#ifdef BTREE_TRACE
+
+/* a thread's records not yet written */
+typedef struct tracebuf_st
+{
+    btreetracerec_td	recs[TRACE_BUFSIZE];
+    int			count;
+    unsigned short	thread;
+    struct tracebuf_st	*next;		/* list of every thread's buffer */
+} tracebuf_td;
+
+/* the current root of a tree we have seen, and its number */
+typedef struct tracetree_st
+{
+    node_td		*root;
+    int			id;
+    struct tracetree_st	*next;		/* hash chain */
+} tracetree_td;
+
+volatile int		BTreeTraceOn = 0;
+__thread int		BTreeTraceDepth = 0;	/* tree calls this thread is inside of */
+
+static FILE		*traceFile = (FILE *) NULL;
+static tracebuf_td	*allBufs = (tracebuf_td *) NULL;
+static unsigned short	nextThread = 0;
+static tracetree_td	*traceTrees[TRACE_TREES];
+static int		nextTree = 0;
+static pthread_mutex_t	traceLock = PTHREAD_MUTEX_INITIALIZER;
+static __thread tracebuf_td	*traceThread = (tracebuf_td *) NULL;
+
+#define TREE_BUCKET(root)	(((unsigned long) (root) >> 4) % TRACE_TREES)
+
+/* append a buffer to the trace file, call with traceLock held */
+static void
+flushBuf(tracebuf_td *b)
+{
+    if (b->count > 0 && traceFile != (FILE *) NULL)
+	fwrite(b->recs, sizeof(btreetracerec_td), b->count, traceFile);
+    b->count = 0;
+}
+
+/*
+ * first time a thread records a call, give it a buffer and an id
+ *
+ * (buffers are never freed, threads come and go but there aren't many)
+ */
+static tracebuf_td *
+newTraceThread(void)
+{
+    tracebuf_td	*b;
+
+    b = (tracebuf_td *) calloc(1, sizeof(tracebuf_td));
+
+    pthread_mutex_lock(&traceLock);
+    b->thread = nextThread++;
+    b->next = allBufs;
+    allBufs = b;
+    pthread_mutex_unlock(&traceLock);
+
+    traceThread = b;
+    return b;
+}
+
+/*
+ * the number of the tree a call was handed <before> and handed back
+ * <after> as its root; an empty or unknown root is a new tree
+ *
+ * (call with traceLock held)
+ */
+static int
+treeId(node_td *before, node_td *after)
+{
+    tracetree_td	**pp, *t = (tracetree_td *) NULL;
+    int			id;
+
+    if (before != (node_td *) NULL) {
+	for (pp = &traceTrees[TREE_BUCKET(before)]; *pp != (tracetree_td *) NULL; pp = &(*pp)->next) {
+	    if ((*pp)->root == before) {
+		t = *pp;
+		*pp = t->next;
+		break;
+	    }
+	}
+    }
+    id = (t != (tracetree_td *) NULL) ? t->id : nextTree++;
+
+    if (after == (node_td *) NULL) {	/* emptied or freed, forget it */
+	free(t);
+	return id;
+    }
+
+    if (t == (tracetree_td *) NULL)
+	t = (tracetree_td *) malloc(sizeof(tracetree_td));
+    t->root = after;
+    t->id = id;
+    t->next = traceTrees[TREE_BUCKET(after)];
+    traceTrees[TREE_BUCKET(after)] = t;
+
+    return id;
+}
+
+/* forget every tree, the next trace numbers them from 0 (call with traceLock held) */
+static void
+clearTrees(void)
+{
+    tracetree_td	*t;
+    int			i;
+
+    for (i=0; i<TRACE_TREES; i++) {
+	while ((t = traceTrees[i]) != (tracetree_td *) NULL) {
+	    traceTrees[i] = t->next;
+	    free(t);
+	}
+    }
+    nextTree = 0;
+}
+
+/*
+ * record one call (the BTREE_TRACE_LEAVE() hook), on the tree whose
+ * root was <before> going in and is <after> coming out
+ */
+void
+BTreeTraceRecord(int op, node_td *before, node_td *after, int key, int hit)
+{
+    tracebuf_td		*b = traceThread;
+    btreetracerec_td	*r;
+
+    if (b == (tracebuf_td *) NULL)
+	b = newTraceThread();
+
+    pthread_mutex_lock(&traceLock);
+
+    r = &b->recs[b->count++];
+    r->key = key;
+    r->tree = treeId(before, after);
+    r->thread = b->thread;
+    r->op = (unsigned char) op;
+    r->hit = (unsigned char) (hit != 0);
+
+    if (b->count == TRACE_BUFSIZE)
+	flushBuf(b);
+
+    pthread_mutex_unlock(&traceLock);
+}
+
+#endif /* BTREE_TRACE */
+
+/*
+ * start recording all tree calls to the file <path> (truncated)
+ *
+ * Returns TRUE if recording started, FALSE if the file can't be written
+ * or the tree code was built without -DBTREE_TRACE.
+ */
+int
+BTreeTraceStart(const char *path)
+{
+#ifdef BTREE_TRACE
+    traceheader_td	hdr;
+    tracebuf_td		*b;
+
+    BTreeTraceStop();
+
+    pthread_mutex_lock(&traceLock);
+    traceFile = fopen(path, "wb");
+    if (traceFile == (FILE *) NULL) {
+	pthread_mutex_unlock(&traceLock);
+	return 0;
+    }
+    hdr.magic = BTREE_TRACE_MAGIC;
+    hdr.recsize = sizeof(btreetracerec_td);
+    fwrite(&hdr, sizeof(hdr), 1, traceFile);
+
+    for (b = allBufs; b != (tracebuf_td *) NULL; b = b->next) {
+	b->count = 0;
+    }
+    clearTrees();
+    BTreeTraceOn = 1;
+    pthread_mutex_unlock(&traceLock);
+
+    return 1;
+#else
+    fprintf(stderr,"BTreeTraceStart : tree code built without -DBTREE_TRACE, not recording %s\n",
+	    path);
+    return 0;
+#endif
+}
+
+/*
+ * stop recording, write out what every thread has buffered and close the trace
+ */
+void
+BTreeTraceStop(void)
+{
+#ifdef BTREE_TRACE
+    tracebuf_td		*b;
+
+    pthread_mutex_lock(&traceLock);
+    BTreeTraceOn = 0;
+    if (traceFile != (FILE *) NULL) {
+	for (b = allBufs; b != (tracebuf_td *) NULL; b = b->next) {
+	    flushBuf(b);
+	}
+	fclose(traceFile);
+	traceFile = (FILE *) NULL;
+    }
+    pthread_mutex_unlock(&traceLock);
+#endif
+}
+
+/*
+ * read the trace at <path> into a malloc'd array of <*count> records
+ *
+ * A partial record at the end (program died while writing) is dropped.
+ * Returns NULL if the file isn't a trace.
+ */
+btreetracerec_td *
+BTreeTraceLoad(const char *path, long *count)
+{
+    FILE		*fp;
+    traceheader_td	hdr;
+    btreetracerec_td	*recs;
+    long		size;
+
+    *count = 0;
+    fp = fopen(path, "rb");
+    if (fp == (FILE *) NULL)
+	return (btreetracerec_td *) NULL;
+
+    if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != BTREE_TRACE_MAGIC ||
+	hdr.recsize != sizeof(btreetracerec_td)) {
+	fprintf(stderr,"BTreeTraceLoad : %s is not a trace file\n", path);
+	fclose(fp);
+	return (btreetracerec_td *) NULL;
+    }
+
+    fseek(fp, 0L, SEEK_END);
+    size = (ftell(fp) - (long) sizeof(hdr)) / (long) sizeof(btreetracerec_td);
+    fseek(fp, (long) sizeof(hdr), SEEK_SET);
+
+    recs = (btreetracerec_td *) malloc((size + 1) * sizeof(btreetracerec_td));
+    *count = (long) fread(recs, sizeof(btreetracerec_td), size, fp);
+    fclose(fp);
+
+    return recs;
+}
+
+/* one of the trees being replayed */
+typedef struct replaytree_st
+{
+    node_td		*root;
+    long		cursor;		/* for BTREE_TRACE_STEP */
+} replaytree_td;
+
+/* state shared by the replay threads */
+typedef struct replay_st
+{
+    btreetracerec_td	*recs;
+    long		count;
+    int			nthreads;
+    replaytree_td	*trees;		/* indexed by the record's tree */
+    int			ntrees;
+    pthread_rwlock_t	lock;
+} replay_td;
+
+/* one replay thread: its share of the records, and its counts */
+typedef struct replayjob_st
+{
+    replay_td		*rp;
+    int			id;
+    btreetraceresult_td	result;
+} replayjob_td;
+
+/* replay one record on its tree */
+static void
+replayRecord(replay_td *rp, btreetracerec_td *r, btreetraceresult_td *result)
+{
+    replaytree_td	*t = &rp->trees[r->tree];
+    node_td		*p;
+    int			hit = -1;
+
+    if (rp->nthreads > 1) {
+	if (r->op == BTREE_TRACE_FIND)
+	    pthread_rwlock_rdlock(&rp->lock);
+	else
+	    pthread_rwlock_wrlock(&rp->lock);
+    }
+
+    switch (r->op) {
+      case BTREE_TRACE_FIND:
+	hit = (BTreeFindNode(t->root, r->key) != (node_td *) NULL);
+	break;
+
+      case BTREE_TRACE_INSERT:
+	t->root = BTreeInsertNode(t->root, r->key, t->root, 0, NULL);
+	break;
+
+      case BTREE_TRACE_DELETE:
+	hit = BTreeDeleteNode(&t->root, r->key);
+	break;
+
+      case BTREE_TRACE_REBALANCE:
+	t->root = BTreeRebalance(t->root);
+	break;
+
+      case BTREE_TRACE_SUBTREE:
+	p = BTreeFindNode(t->root, r->key);
+	if (p != (node_td *) NULL)
+	    BTreeRebalanceSubtree(&t->root, p);
+	break;
+
+      case BTREE_TRACE_STEP:
+	BTreeRebalanceStep(&t->root, &t->cursor, r->key);
+	break;
+
+      case BTREE_TRACE_FREE:
+	t->root = BTreeFreeTree(t->root);
+	t->cursor = BTREE_REBALANCE_START;
+	break;
+
+      default:
+	break;
+    }
+
+    if (rp->nthreads > 1)
+	pthread_rwlock_unlock(&rp->lock);
+
+    if (r->op < BTREE_TRACE_OPS)
+	result->ops[r->op]++;
+    if (hit >= 0 && hit != r->hit)
+	result->mismatches++;
+}
+
+static void *
+replayThread(void *arg)
+{
+    replayjob_td	*job = (replayjob_td *) arg;
+    replay_td		*rp = job->rp;
+    long		i;
+
+    for (i=0; i<rp->count; i++) {
+	if (rp->recs[i].thread % rp->nthreads == job->id && rp->recs[i].tree >= 0)
+	    replayRecord(rp, &rp->recs[i], &job->result);
+    }
+
+    return NULL;
+}
+
+/*
+ * replay <count> trace records on new, empty trees, with <nthreads>
+ * threads, and fill in <result> (the trees are freed afterwards)
+ *
+ * Mismatches count finds and deletes that came out differently than when
+ * recorded. With one thread and trees that started empty and were only
+ * changed by recorded calls there should be none; with several threads
+ * the interleaving is new.
+ */
+void
+BTreeTraceReplay(btreetracerec_td *recs, long count, int nthreads, btreetraceresult_td *result)
+{
+    replay_td		rp;
+    replayjob_td	*jobs;
+    pthread_t		*tids;
+    unsigned long	start;
+    long		n;
+    int			i, j;
+
+    if (nthreads < 1)
+	nthreads = 1;
+
+    rp.recs = recs;
+    rp.count = count;
+    rp.nthreads = nthreads;
+    rp.ntrees = 0;
+    for (n=0; n<count; n++) {
+	if (recs[n].tree >= rp.ntrees)
+	    rp.ntrees = recs[n].tree + 1;
+    }
+    rp.trees = (replaytree_td *) malloc((rp.ntrees + 1) * sizeof(replaytree_td));
+    for (i=0; i<rp.ntrees; i++) {
+	rp.trees[i].root = (node_td *) NULL;
+	rp.trees[i].cursor = BTREE_REBALANCE_START;
+    }
+    pthread_rwlock_init(&rp.lock, NULL);
+
+    jobs = (replayjob_td *) calloc(nthreads, sizeof(replayjob_td));
+    tids = (pthread_t *) malloc(nthreads * sizeof(pthread_t));
+    for (i=0; i<nthreads; i++) {
+	jobs[i].rp = &rp;
+	jobs[i].id = i;
+    }
+
+    start = traceClock();
+    for (i=1; i<nthreads; i++) {
+	if (pthread_create(&tids[i], NULL, replayThread, &jobs[i]) != 0) {
+	    replayThread(&jobs[i]);	/* no thread, do it ourselves */
+	    tids[i] = pthread_self();
+	}
+    }
+    replayThread(&jobs[0]);
+    for (i=1; i<nthreads; i++) {
+	if (!pthread_equal(tids[i], pthread_self()))
+	    pthread_join(tids[i], NULL);
+    }
+
+    memset(result, 0, sizeof(btreetraceresult_td));
+    result->ns = traceClock() - start;
+    for (i=0; i<nthreads; i++) {
+	for (j=0; j<BTREE_TRACE_OPS; j++) {
+	    result->ops[j] += jobs[i].result.ops[j];
+	}
+	result->mismatches += jobs[i].result.mismatches;
+    }
+    for (i=0; i<rp.ntrees; i++) {
+	result->nodes += BTreeCountNodes(rp.trees[i].root);
+	BTreeFreeTree(rp.trees[i].root);
+    }
+    free(rp.trees);
+    pthread_rwlock_destroy(&rp.lock);
+    free(jobs);
+    free(tids);
+}
+
+/*
+ * print out a replay result as text
+ */
+void
+BTreeTracePrint(FILE *fp, btreetraceresult_td *result)
+{
+    unsigned long	total = 0;
+    int			i;
+
+    for (i=0; i<BTREE_TRACE_OPS; i++) {
+	if (result->ops[i] != 0)
+	    fprintf(fp,"%s calls %lu\n", opNames[i], result->ops[i]);
+	total += result->ops[i];
+    }
+
+    fprintf(fp,"%lu calls in %.3f ms", total, (double) result->ns / 1000000.0);
+    if (result->ns != 0)
+	fprintf(fp," (%.0f calls/s, %.1f ns/call)",
+		(double) total * 1000000000.0 / (double) result->ns,
+		(total != 0) ? (double) result->ns / (double) total : 0.0);
+    fprintf(fp,"\n");
+
+    fprintf(fp,"%d nodes at the end, %lu finds/deletes differ from the recording\n",
+	    result->nodes, result->mismatches);
+}
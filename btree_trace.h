@@ -0,0 +1,84 @@
+/*
+ * File:	btree_trace.h
+ *
+ * Include file for btree_trace.c, recording and replaying traces of tree calls.
+ *
+ * Compile with -DBTREE_TRACE to put the recording hooks in the tree code.
+ * Without it the BTREE_TRACE_*() hooks compile to nothing; loading and
+ * replaying traces works either way.
+ *
+ */
+#ifndef __BTREE_TRACE_H__
+#define __BTREE_TRACE_H__
+
+#include <stdio.h>
+
+#define BTREE_TRACE_MAGIC	0x42545452	/* "BTTR" */
+
+/* the calls we record (the first four match the BTREE_OP_* of btree_stats.h) */
+#define BTREE_TRACE_FIND	0
+#define BTREE_TRACE_INSERT	1
+#define BTREE_TRACE_DELETE	2
+#define BTREE_TRACE_REBALANCE	3	/* BTreeRebalance() */
+#define BTREE_TRACE_SUBTREE	4	/* BTreeRebalanceSubtree(), key = top of the subtree */
+#define BTREE_TRACE_STEP	5	/* BTreeRebalanceStep(), key = budget */
+#define BTREE_TRACE_FREE	6	/* BTreeFreeTree() */
+#define BTREE_TRACE_OPS		7
+
+/* one recorded call, 12 bytes */
+typedef struct btreetracerec_st
+{
+    int			key;
+    int			tree;		/* which tree, numbered from 0 as they show up */
+    unsigned short	thread;		/* which thread made the call */
+    unsigned char	op;		/* BTREE_TRACE_* */
+    unsigned char	hit;		/* find found the key, delete deleted it */
+} btreetracerec_td;
+
+/* what a replay did and how long it took */
+typedef struct btreetraceresult_st
+{
+    unsigned long	ops[BTREE_TRACE_OPS];	/* calls replayed */
+    unsigned long	mismatches;	/* finds/deletes whose hit differs from the recording */
+    unsigned long	ns;		/* wall clock time of the whole replay */
+    int			nodes;		/* nodes in the trees at the end */
+} btreetraceresult_td;
+
+extern int		BTreeTraceStart(const char *path);
+extern void		BTreeTraceStop(void);
+extern btreetracerec_td	*BTreeTraceLoad(const char *path, long *count);
+extern void		BTreeTraceReplay(btreetracerec_td *recs, long count, int nthreads,
+				 btreetraceresult_td *result);
+extern void		BTreeTracePrint(FILE *fp, btreetraceresult_td *result);
+
+#ifdef BTREE_TRACE
+
+extern volatile int	BTreeTraceOn;
+extern __thread int	BTreeTraceDepth;
+extern void		BTreeTraceRecord(int op, node_td *before, node_td *after, int key, int hit);
+
+/*
+ * A public tree call starts with BTREE_TRACE_ENTER(), which keeps the
+ * root it was handed in <tree>, and ends with BTREE_TRACE_LEAVE() and
+ * the root it hands back (or BTREE_TRACE_QUIET() if it isn't recorded).
+ * Only the outermost call is recorded, not the tree calls it makes on
+ * the way; following the root from call to call tells the trees apart.
+ * While no trace is being recorded that's a counter and a branch.
+ */
+#define BTREE_TRACE_ENTER(tree, root)	node_td *tree = (root); BTreeTraceDepth++
+#define BTREE_TRACE_LEAVE(op, tree, root, key, hit)				\
+	do {									\
+	    if (--BTreeTraceDepth == 0 && BTreeTraceOn)				\
+		BTreeTraceRecord((op), (tree), (root), (key), (hit));		\
+	} while (0)
+#define BTREE_TRACE_QUIET(tree)		((void) (tree), BTreeTraceDepth--)
+
+#else
+
+#define BTREE_TRACE_ENTER(tree, root)
+#define BTREE_TRACE_LEAVE(op, tree, root, key, hit)
+#define BTREE_TRACE_QUIET(tree)
+
+#endif /* BTREE_TRACE */
+
+#endif /* __BTREE_TRACE_H__ */
@@ -5,6 +5,10 @@
  *
  * Create a tree filled with random data, then print it out in various ways.
  *
+ * With -w the tree calls of the run are recorded to a trace file (needs
+ * -DBTREE_TRACE), with -r a trace is replayed and timed instead, on
+ * -t threads.
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -14,6 +18,19 @@
 
 #include "btree.h"
 #include "btree_util.h"
+#include "btree_set.h"
+#include "btree_snap.h"
+#include "btree_shard.h"
+#include "btree_stats.h"
+#include "btree_trace.h"
+#include "btree_interval.h"
+#include "btree_filter.h"
+#include "btree_batch.h"
+#include "btree_finger.h"
+#include "btree_cache.h"
+#include "btree_layout.h"
+#include "btree_log.h"
+#include "btree_ingest.h"
 
 char    *ProgramName;
 
@@ -28,8 +45,25 @@ char    *ProgramName;
  * (it works just fine with larger values, but the output gets unwieldly)
  */
 #define MAX_KEY (32)
+
+/* write-ahead log for the log demo (and <TEST_LOG>.ckpt), removed afterwards */
+#define TEST_LOG	"btree_test.log"
 static int	test_size = MAX_KEY;
 
+/* BTreeShardScan() callback, print out the key */
+static void
+print_key(int key, void *data, void *arg)
+{
+    fprintf(stdout,"(%d) ",key);
+}
+
+/* interval query callback, print out the interval */
+static void
+print_interval(int start, int end, void *data, void *arg)
+{
+    fprintf(stdout,"[%d,%d] ",start,end);
+}
+
 static float
 my_rand(void)
 {
@@ -48,7 +82,22 @@ int
 main(int argc, char *argv[])
 {
     int         i, key;
-    node_td	*root;
+    double	value;
+    char	*tracefile = (char *) NULL, *replayfile = (char *) NULL;
+    int		nthreads = 1;
+    int		*batch;
+    long	count;
+    btreetracerec_td	*recs;
+    btreetraceresult_td	replay;
+    node_td	*root, *other, *result, *snap, *finger, *recovered;
+    shardtree_td	*shards;
+    btreefilter_td	*filter;
+    btreecache_td	*cache;
+    btreelog_td		*log;
+    btreeingest_td	*ingest;
+#ifdef BTREE_STATS
+    btreestats_td	stats;
+#endif
 
     ProgramName = (char *) malloc(strlen(argv[0])+1);
     strcpy(ProgramName, argv[0]);
@@ -58,7 +107,7 @@ main(int argc, char *argv[])
     srand((unsigned) time(NULL)); 
  */
 
-#define USAGE_STRING    "[-h] [-s size]"
+#define USAGE_STRING    "[-h] [-s size] [-w tracefile] [-r tracefile [-t threads]]"
 
     while ((argc > 1) && (argv[1][0] == '-')) {
 
@@ -74,6 +123,24 @@ main(int argc, char *argv[])
 	    argc--;
 	    argv++;
             break;
+
+          case 'w':
+	    tracefile = argv[2];
+	    argc--;
+	    argv++;
+            break;
+
+          case 'r':
+	    replayfile = argv[2];
+	    argc--;
+	    argv++;
+            break;
+
+          case 't':
+	    nthreads = atoi(argv[2]);
+	    argc--;
+	    argv++;
+            break;
    
           default:
             fprintf(stderr,"%s : %s : program option [%s] not recognized. (File %s, line %d)\n", 
@@ -86,6 +153,30 @@ main(int argc, char *argv[])
     }
 
 
+	/* replay a recorded trace, time it and we're done */
+
+    if (replayfile != (char *) NULL) {
+	recs = BTreeTraceLoad(replayfile, &count);
+	if (recs == (btreetracerec_td *) NULL) {
+	    fprintf(stderr,"%s : can't read trace %s\n",ProgramName,replayfile);
+	    exit(EXIT_FAILURE);
+	}
+
+	fprintf(stdout,"%s : Replay of %s, %ld calls, %d thread(s):\n",
+		ProgramName,replayfile,count,nthreads);
+	BTreeTraceReplay(recs, count, nthreads, &replay);
+	BTreeTracePrint(stdout, &replay);
+	free(recs);
+#ifdef BTREE_STATS
+	BTreeStatsGet(&stats);
+	BTreeStatsPrint(stdout, &stats);
+#endif
+	exit(EXIT_SUCCESS);
+    }
+
+    if (tracefile != (char *) NULL)
+	BTreeTraceStart(tracefile);
+
     /*
      * build a binary tree.
      *
@@ -138,6 +229,41 @@ main(int argc, char *argv[])
     }
     fprintf(stdout,"\n");
 
+	/* the same searches with a filter in front: most misses never get to the tree */
+
+    filter = BTreeFilterNew(test_size);
+    BTreeFilterBuild(filter, root);
+    for (i=0, key=0, count=0; i<test_size; i++) {
+	if (!BTreeFilterMayContain(filter, i))
+	    key++;
+	if (BTreeFilterFindNode(filter, root, i) != BTreeFindNode(root, i))
+	    count++;
+    }
+    fprintf(stdout,"%s : the filter turns away %d of the %d searches that are Not Found!\n",
+	ProgramName, key, test_size - BTreeCountNodes(root));
+    fprintf(stdout,"%s : %ld filtered searches disagree with the tree\n\n",ProgramName,count);
+    BTreeFilterFree(filter);
+
+	/* and a tree of inline values kept in step with its filter: the even keys, less one */
+
+    filter = BTreeFilterNew(test_size);
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i+=2) {
+	value = i * 0.5;
+	other = BTreeFilterInsertValue(filter, other, i, &value, sizeof(value));
+    }
+    BTreeFilterDeleteNode(filter, &other, test_size/2);
+    for (i=0, key=0; i<test_size; i++) {
+	result = BTreeFilterFindNode(filter, other, i);
+	if ((result != (node_td *) NULL) != (i % 2 == 0 && i != test_size/2))
+	    key++;
+	else if (result != (node_td *) NULL && *(double *) result->data != i * 0.5)
+	    key++;
+    }
+    fprintf(stdout,"%s : %d filtered searches of a value tree went wrong\n\n",ProgramName,key);
+    other = BTreeFreeTree(other);
+    BTreeFilterFree(filter);
+
     fprintf(stdout,"%s: delete node (%d) ",ProgramName,13);
     if (BTreeDeleteNode(&root, 13)) {
         fprintf(stdout,"%s%s%s\n", GREEN_COLOR_TEXT, "Success!", DEFAULT_COLOR_TEXT);	
@@ -205,6 +331,397 @@ main(int argc, char *argv[])
     fprintf(stdout,"\n");
     fprintf(stdout,"\n");
 
+	/* set operations against a second tree holding the even keys */
+
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i+=2) {
+	other = BTreeInsertNode(other, i, other, 0, NULL);
+    }
+    fprintf(stdout,"%s : Second tree (even keys):\n",ProgramName);
+    BTreeUtilPrintByInorderTraversal(other);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    fprintf(stdout,"%s : Union:\n",ProgramName);
+    result = BTreeUnion(root, other, 1);
+    BTreeUtilPrintByInorderTraversal(result);
+    result = BTreeFreeTree(result);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    fprintf(stdout,"%s : Intersection:\n",ProgramName);
+    result = BTreeIntersection(root, other, 1);
+    BTreeUtilPrintByInorderTraversal(result);
+    result = BTreeFreeTree(result);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    fprintf(stdout,"%s : Difference:\n",ProgramName);
+    result = BTreeDifference(root, other, 1);
+    BTreeUtilPrintByInorderTraversal(result);
+    result = BTreeFreeTree(result);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    other = BTreeFreeTree(other);
+
+	/* persistent tree: take a snapshot, keep changing the tree,
+	 * the snapshot doesn't see the changes
+	 */
+
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i+=2) {
+	other = BTreeSnapInsert(other, i, NULL);
+    }
+    snap = BTreeSnapshot(other);
+    for (i=0; i<test_size; i+=4) {
+	other = BTreeSnapDelete(other, i);
+    }
+    other = BTreeSnapInsert(other, 1, NULL);
+
+    fprintf(stdout,"%s : Snapshot:\n",ProgramName);
+    BTreeUtilPrintByInorderTraversal(snap);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+    fprintf(stdout,"%s : Tree after deletes since the snapshot:\n",ProgramName);
+    BTreeUtilPrintByInorderTraversal(other);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    BTreeSnapRelease(snap);
+    BTreeSnapRelease(other);
+
+	/* sharded tree: 4 shards, then split the first one */
+
+    shards = BTreeShardNew(4, 0, test_size-1);
+    for (i=1; i<test_size; i++) {
+	key = (int) (my_rand() * (float)test_size);
+	BTreeShardInsert(shards, key, NULL);
+    }
+    BTreeShardSplit(shards, 0);
+
+    fprintf(stdout,"%s : Sharded tree, %d shards:\n",ProgramName,shards->nshards);
+    BTreeShardScan(shards, 0, test_size-1, print_key, NULL);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    BTreeShardFree(shards);
+
+	/* inline values: each node keeps its own copy of a double, the
+	 * key squared, which survives deletes moving the nodes around
+	 */
+
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i++) {
+	value = (double) i * i;
+	other = BTreeInsertValue(other, i, &value, sizeof(value));
+    }
+    for (i=0; i<test_size; i+=3) {
+	BTreeDeleteNode(&other, i);
+    }
+
+    fprintf(stdout,"%s : Inline values (%d bytes):\n",ProgramName,BTreeNodeValueSize(other));
+    for (i=0; i<test_size; i++) {
+	result = BTreeFindNode(other, i);
+	if (result != (node_td *) NULL) {
+	    BTreeNodeGetValue(result, &value);
+	    fprintf(stdout,"(%d:%g) ",i,value);
+	}
+    }
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    other = BTreeFreeTree(other);
+
+	/* batches: the odd keys in one go (reversed, with duplicates),
+	 * then take every fourth key out again
+	 */
+
+    batch = (int *) malloc(test_size * sizeof(int));
+    for (i=0; i<test_size; i++) {
+	batch[i] = (test_size - 1 - i) | 1;
+    }
+    other = BTreeBatchInsert((node_td *) NULL, batch, (void **) NULL, test_size, 0);
+    for (i=0; i<test_size/4; i++) {
+	batch[i] = 4*i + 1;
+    }
+    BTreeBatchDelete(&other, batch, test_size/4);
+
+    fprintf(stdout,"%s : Batch inserted odd keys, batch deleted every fourth:\n",ProgramName);
+    BTreeUtilPrintByInorderTraversal(other);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    other = BTreeFreeTree(other);
+
+	/* a small batch past the end of a balanced tree should not hang
+	 * off it as a chain
+	 */
+
+    for (i=0; i<test_size; i++) {
+	batch[i] = i;
+    }
+    other = BTreeBatchInsert((node_td *) NULL, batch, (void **) NULL, test_size, 0);
+    fprintf(stdout,"%s : Balanced tree of %d keys is %d levels high, ",ProgramName,test_size,BTreeGetHeight(other));
+    for (i=0; i<test_size/16; i++) {
+	batch[i] = test_size + i;
+    }
+    other = BTreeBatchInsert(other, batch, (void **) NULL, test_size/16, 0);
+    fprintf(stdout,"%d after a batch of %d keys past the end\n",BTreeGetHeight(other),test_size/16);
+    if (BTreeGetHeight(other) > 2 + (int) ceil(log2(BTREE_SIZE(other) + 1)))
+	fprintf(stdout,"%s : ERROR: batch insert left the tree unbalanced\n",ProgramName);
+    fprintf(stdout,"\n");
+    free(batch);
+
+    other = BTreeFreeTree(other);
+
+	/* interval tree: random intervals up to 8 long, which hold the middle key? */
+
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i++) {
+	key = (int) (my_rand() * (float)test_size);
+	other = BTreeIntervalInsert(other, key, key + (int) (my_rand() * 8.0), NULL);
+    }
+    BTreeIntervalDelete(&other, test_size/2);
+
+    fprintf(stdout,"%s : Intervals holding %d:\n",ProgramName,test_size/2);
+    BTreeIntervalStab(other, test_size/2, print_interval, NULL);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"%s : Intervals overlapping [%d,%d]:\n",ProgramName,test_size/4,test_size/4+2);
+    BTreeIntervalOverlap(other, test_size/4, test_size/4+2, print_interval, NULL);
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    other = BTreeFreeTree(other);
+
+	/* the rest builds trees with calls a trace doesn't record (batches,
+	 * finger inserts, buffered ingest, relayout), which a replay couldn't
+	 * follow, so the recording ends here
+	 */
+
+    if (tracefile != (char *) NULL)
+	BTreeTraceStop();
+
+	/* finger search: a tree of inline values, the even keys in a batch
+	 * (values zeroed), then the odd keys (the key squared) finger
+	 * inserted in order, each one starting from the last instead of
+	 * from the root
+	 */
+
+    batch = (int *) malloc(test_size * sizeof(int));
+    for (i=0; i<test_size/2; i++) {
+	batch[i] = 2*i;
+    }
+    other = BTreeBatchInsert((node_td *) NULL, batch, (void **) NULL, test_size/2, sizeof(value));
+    finger = other;
+    for (i=0; i<test_size/2; i++) {
+	batch[i] = 2*i + 1;
+	value = (double) batch[i] * batch[i];
+	other = BTreeFingerInsertValue(other, &finger, batch[i], &value, sizeof(value));
+    }
+    BTreeFingerFixSizes(other, batch, test_size/2);
+    free(batch);
+
+    fprintf(stdout,"%s : Finger inserted odd keys (%d nodes, sizes say %d):\n",
+	ProgramName,BTreeCountNodes(other),BTREE_SIZE(other));
+    finger = other;
+    for (i=0; i<test_size; i++) {
+	result = BTreeFingerFindNode(&finger, i);
+	if (result != (node_td *) NULL) {
+	    BTreeNodeGetValue(result, &value);
+	    fprintf(stdout,"(%d:%g) ",i,value);
+	}
+    }
+    fprintf(stdout,"\n");
+    fprintf(stdout,"\n");
+
+    other = BTreeFreeTree(other);
+
+	/* front cache: look every key up twice (the second pass mostly hits
+	 * the cache), delete one through the cache, then re-pack the tree
+	 * and clear the cache, which would point at the old nodes otherwise
+	 */
+
+    batch = (int *) malloc(test_size * sizeof(int));
+    for (i=0; i<test_size; i++) {
+	batch[i] = i;
+    }
+    other = BTreeBatchInsert((node_td *) NULL, batch, (void **) NULL, test_size, 0);
+    free(batch);
+
+    cache = BTreeCacheNew(test_size);
+    for (i=0, key=0; i<2*test_size; i++) {
+	if (BTreeCacheFindNode(cache, other, i % test_size) != (node_td *) NULL)
+	    key++;
+    }
+    fprintf(stdout,"%s : Cached lookups found %d of %d keys\n",ProgramName,key,2*test_size);
+
+    BTreeCacheDeleteNode(cache, &other, test_size/2);
+    fprintf(stdout,"%s : deleted (%d) through the cache, cache lookup %s\n",ProgramName,test_size/2,
+	(BTreeCacheFindNode(cache, other, test_size/2) == (node_td *) NULL) ? "misses" : "ERROR: still hits");
+
+    other = BTreeRelayout(other, BTREE_LAYOUT_BFS);
+    BTreeCacheClear(cache);
+    for (i=0, key=0; i<test_size; i++) {
+	if (BTreeCacheFindNode(cache, other, i) != BTreeFindNode(other, i))
+	    key++;
+    }
+    fprintf(stdout,"%s : after relayout and clear, %d cached lookups disagree with the tree\n",ProgramName,key);
+    fprintf(stdout,"\n");
+    BTreeCacheFree(cache);
+
+    other = BTreeFreeTree(other);
+
+	/* write-ahead log: random inserts (inline values, half the key),
+	 * a checkpoint half way through, then deletes of every third key;
+	 * recovering from the checkpoint and the log gives the same tree
+	 */
+
+    remove(TEST_LOG);
+    remove(TEST_LOG ".ckpt");
+    log = BTreeLogOpen(TEST_LOG, sizeof(value), 8);
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i++) {
+	key = (int) (my_rand() * (float)test_size);
+	value = key * 0.5;
+	BTreeLogInsertNode(log, &other, key, &value);
+	if (i == test_size/2)
+	    BTreeLogCheckpoint(log, other);
+    }
+    for (i=0; i<test_size; i+=3) {
+	BTreeLogDeleteNode(log, &other, i);
+    }
+    fprintf(stdout,"%s : Logged %d inserts and deletes of every third key, epoch %ld\n",
+	ProgramName,test_size,log->epoch);
+    BTreeLogClose(log);
+
+    recovered = BTreeLogRecover(TEST_LOG, sizeof(value));
+    fprintf(stdout,"%s : Recovered tree:\n",ProgramName);
+    BTreeUtilPrintByInorderTraversal(recovered);
+    fprintf(stdout,"\n");
+    for (i=0, key=0; i<test_size; i++) {
+	node_td *p = BTreeFindNode(other, i);
+	node_td *q = BTreeFindNode(recovered, i);
+	if (p == (node_td *) NULL || q == (node_td *) NULL) {
+	    if (p != q)
+		key++;
+	} else if (*(double *) p->data != *(double *) q->data) {
+	    key++;
+	}
+    }
+    fprintf(stdout,"%s : %d keys differ from the logged tree\n",ProgramName,key);
+    fprintf(stdout,"\n");
+    remove(TEST_LOG);
+    remove(TEST_LOG ".ckpt");
+
+    recovered = BTreeFreeTree(recovered);
+    other = BTreeFreeTree(other);
+
+	/* buffered ingest: random inserts, then deletes of every third key,
+	 * through buffers of 8 writes, so several buffers get merged by the
+	 * background thread; the same writes made directly give the same tree
+	 */
+
+    ingest = BTreeIngestNew((node_td *) NULL, 8);
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i++) {
+	key = (int) (my_rand() * (float)test_size);
+	BTreeIngestInsert(ingest, key, NULL);
+	other = BTreeInsertNode(other, key, other, 0, NULL);
+    }
+    for (i=0; i<test_size; i+=3) {
+	BTreeIngestDelete(ingest, i);
+	BTreeDeleteNode(&other, i);
+    }
+    for (i=0, key=0; i<test_size; i++) {
+	if (BTreeIngestFind(ingest, i, (void **) NULL) != (BTreeFindNode(other, i) != (node_td *) NULL))
+	    key++;
+    }
+    recovered = BTreeIngestFree(ingest);
+
+    fprintf(stdout,"%s : Ingested tree (%d nodes, sizes say %d):\n",
+	ProgramName,BTreeCountNodes(recovered),BTREE_SIZE(recovered));
+    BTreeUtilPrintByInorderTraversal(recovered);
+    fprintf(stdout,"\n");
+    for (i=0; i<test_size; i++) {
+	if ((BTreeFindNode(recovered, i) == (node_td *) NULL) != (BTreeFindNode(other, i) == (node_td *) NULL))
+	    key++;
+    }
+    fprintf(stdout,"%s : %d lookups differ from the tree written directly\n",ProgramName,key);
+    fprintf(stdout,"\n");
+
+    recovered = BTreeFreeTree(recovered);
+    other = BTreeFreeTree(other);
+
+	/* relayout: re-pack a random tree level by level, then in van Emde
+	 * Boas order; the keys, their order and their data stay the same
+	 */
+
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i++) {
+	key = (int) (my_rand() * (float)test_size);
+	other = BTreeInsertNode(other, key, other, 0, (void *) (long) key);
+    }
+    batch = (int *) malloc(2 * test_size * sizeof(int));
+    count = BTreeFlatten(other, batch, (void **) NULL);
+
+    for (i=0; i<2; i++) {
+	int	n, j, bad = 0;
+
+	other = BTreeRelayout(other, (i == 0) ? BTREE_LAYOUT_BFS : BTREE_LAYOUT_VEB);
+	n = BTreeFlatten(other, batch + test_size, (void **) NULL);
+	if (n != count || memcmp(batch, batch + test_size, n * sizeof(int)) != 0)
+	    bad++;
+	for (j=0; j<n; j++) {
+	    result = BTreeFindNode(other, batch[j]);
+	    if (result == (node_td *) NULL || result->data != (void *) (long) batch[j])
+		bad++;
+	}
+	fprintf(stdout,"%s : %s relayout, %d nodes, %d levels, %d differences:\n",
+	    ProgramName,(i == 0) ? "BFS" : "vEB",n,BTreeGetHeight(other),bad);
+	BTreeUtilPrintByInorderTraversal(other);
+	fprintf(stdout,"\n");
+    }
+    fprintf(stdout,"\n");
+    free(batch);
+
+    other = BTreeFreeTree(other);
+
+	/* rebalancing: keys inserted in order make a chain; fix it a few
+	 * nodes worth of work at a time, then rebuild just one subtree of a
+	 * fresh chain
+	 */
+
+    other = (node_td *) NULL;
+    for (i=0; i<test_size; i++) {
+	other = BTreeInsertNode(other, i, other, 0, NULL);
+    }
+    fprintf(stdout,"%s : Keys inserted in order, %d levels\n",ProgramName,BTreeGetHeight(other));
+    count = BTREE_REBALANCE_START;
+    for (i=0; i<4; i++) {
+	key = BTreeRebalanceStep(&other, &count, test_size/2);
+	fprintf(stdout,"%s : rebalance step %d (budget %d) rebuilt %d nodes, %d levels\n",
+	    ProgramName,i+1,test_size/2,key,BTreeGetHeight(other));
+    }
+    other = BTreeFreeTree(other);
+
+    for (i=0; i<test_size; i++) {
+	other = BTreeInsertNode(other, i, other, 0, NULL);
+    }
+    BTreeRebalanceSubtree(&other, other->right);
+    fprintf(stdout,"%s : chain with the root's right subtree rebalanced, %d levels\n",
+	ProgramName,BTreeGetHeight(other));
+    fprintf(stdout,"\n");
+
+    other = BTreeFreeTree(other);
+
+#ifdef BTREE_STATS
+    fprintf(stdout,"%s : Stats:\n",ProgramName);
+    BTreeStatsGet(&stats);
+    BTreeStatsPrint(stdout, &stats);
+    fprintf(stdout,"\n");
+#endif
+
     exit (EXIT_SUCCESS);
 
 